@@ -51,6 +51,7 @@ static void *core_proxy(void *arg)
 	struct Apicst *new_st = calloc(1, sizeof(struct Apicst));
 	new_st->type = ASlapic;
 	new_st->lapic.id = get_apic_id();
+	new_st->lapic.os_id = coreid;
 
 	struct Srat *new_srat = calloc(1, sizeof(struct Srat));
 	new_srat->type = SRlapic;
@@ -67,12 +68,18 @@ static void *core_proxy(void *arg)
 
 void acpiinit()
 {
-	int ncpus = get_nprocs();
+	/* Only visit the cores we are allowed to run on. Inside a container
+	 * these may be a sparse subset of the machine, and pinning to any other
+	 * core would fail and leave us reading the apic id of the wrong one. */
+	cpu_set_t cpus;
+	get_allowed_cpus(&cpus);
+	int ncpus = CPU_COUNT(&cpus);
 	pthread_t pthread[ncpus];
 
 	apics = calloc(1, sizeof(struct Madt));
-	for (int i=0; i<ncpus; i++) {
-		pthread_create(&pthread[i], NULL, core_proxy, (void*)(long)i);
+	for (int i=0, j=0; j<ncpus; i++) {
+		if (CPU_ISSET(i, &cpus))
+			pthread_create(&pthread[j++], NULL, core_proxy, (void*)(long)i);
 	}
 	for (int i=0; i<ncpus; i++) {
 		pthread_join(pthread[i], NULL);
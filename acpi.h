@@ -11,6 +11,7 @@ struct Apicst {
 	int type;
 	struct {
 		int id;
+		int os_id;
 	} lapic;
 	struct Apicst *next;
 };
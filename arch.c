@@ -34,6 +34,9 @@
 #include <sched.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include <stdbool.h>
 #include "arch.h"
@@ -45,7 +48,104 @@ void pin_to_core(int coreid)
 	CPU_ZERO(&cpuset);
 	CPU_SET(coreid, &cpuset);
 	sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
-	sched_yield();
+}
+
+/* Parse a kernel cpu list (e.g. "0-3,8,10-11") into 'cpus'. Returns 0 on
+ * success. */
+int parse_cpulist(const char *list, cpu_set_t *cpus)
+{
+	CPU_ZERO(cpus);
+	while (*list && *list != '\n') {
+		char *end;
+		long first = strtol(list, &end, 10), last = first;
+		if (end == list)
+			return -1;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list)
+				return -1;
+		}
+		for (long i = first; i <= last && i < CPU_SETSIZE; i++)
+			CPU_SET(i, cpus);
+		list = end;
+		if (*list == ',')
+			list++;
+	}
+	return 0;
+}
+
+/* Read a kernel cpu list from a file. Returns 0 on success. */
+int read_cpulist(const char *path, cpu_set_t *cpus)
+{
+	char buf[4096];
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	char *line = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (line == NULL)
+		return -1;
+	return parse_cpulist(line, cpus);
+}
+
+/* Read the effective cpus of the cpuset cgroup we run in, for both cgroup
+ * v2 and v1 hierarchies. Returns 0 on success. */
+static int read_cgroup_cpuset(cpu_set_t *cpus)
+{
+	char line[4096], path[4096 + 64];
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (f == NULL)
+		return -1;
+
+	int ret = -1;
+	while (ret != 0 && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		char *controllers = strchr(line, ':');
+		char *cgroup = controllers ? strchr(controllers + 1, ':') : NULL;
+		if (cgroup == NULL)
+			continue;
+		*cgroup++ = '\0';
+		controllers++;
+		if (strcmp(line, "0") == 0 && *controllers == '\0') {
+			snprintf(path, sizeof(path),
+			         "/sys/fs/cgroup%s/cpuset.cpus.effective", cgroup);
+			ret = read_cpulist(path, cpus);
+		} else if (strstr(controllers, "cpuset")) {
+			snprintf(path, sizeof(path),
+			         "/sys/fs/cgroup/cpuset%s/cpuset.effective_cpus", cgroup);
+			ret = read_cpulist(path, cpus);
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+/* Get the set of OS cores we may run on: our affinity mask, further limited
+ * by the cpuset of our cgroup when we can read it. */
+void get_allowed_cpus(cpu_set_t *cpus)
+{
+	cpu_set_t cgroup_cpus;
+
+	if (sched_getaffinity(0, sizeof(cpu_set_t), cpus) != 0) {
+		CPU_ZERO(cpus);
+		for (int i = 0; i < get_nprocs() && i < CPU_SETSIZE; i++)
+			CPU_SET(i, cpus);
+	}
+	if (read_cgroup_cpuset(&cgroup_cpus) == 0 && CPU_COUNT(&cgroup_cpus))
+		CPU_AND(cpus, cpus, &cgroup_cpus);
+}
+
+/* Get the set of OS cores the kernel keeps apart for latency critical work,
+ * i.e. those given to isolcpus= or nohz_full= on its command line. */
+void get_isolated_cpus(cpu_set_t *cpus)
+{
+	cpu_set_t nohz_cpus;
+
+	if (read_cpulist("/sys/devices/system/cpu/isolated", cpus) != 0)
+		CPU_ZERO(cpus);
+	if (read_cpulist("/sys/devices/system/cpu/nohz_full", &nohz_cpus) == 0)
+		CPU_OR(cpus, cpus, &nohz_cpus);
 }
 
 uint32_t get_apic_id()
@@ -8,9 +8,14 @@
 #define ARCH_H_
 
 #include <stdint.h>
+#include <sched.h>
 
 void pin_to_core(int coreid);
 uint32_t get_apic_id();
+int parse_cpulist(const char *list, cpu_set_t *cpus);
+int read_cpulist(const char *path, cpu_set_t *cpus);
+void get_allowed_cpus(cpu_set_t *cpus);
+void get_isolated_cpus(cpu_set_t *cpus);
 
 static inline void cpuid(uint32_t info1, uint32_t info2, uint32_t *eaxp,
                          uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
@@ -30,4 +35,11 @@ static inline void cpuid(uint32_t info1, uint32_t info2, uint32_t *eaxp,
 		*edxp = edx;
 }
 
+static inline uint64_t read_tsc()
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
 #endif /* !ARCH_H */
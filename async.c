@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* An asynchronous front end to the allocator. Producers push requests on a
+ * lock free stack; a single scheduler thread takes the whole stack at once,
+ * restores submission order and runs it with sched_run_batch(), in chunks
+ * of at most max_batch requests so that no request waits behind an
+ * unbounded amount of work. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "async.h"
+#include "stats.h"
+
+static struct sched_request *pending;
+static int wake_fd = -1;
+static int max_batch;
+static pthread_t async_thread;
+static volatile bool running;
+
+/* Wake whoever waits on eventfd fd, retrying only if interrupted: a full
+ * counter (EAGAIN) wakes them just as well, and waiters on a request's efd
+ * also poll its done flag. */
+static void signal_fd(int fd)
+{
+	uint64_t one = 1;
+	while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+}
+
+static void complete(struct sched_request *r)
+{
+	/* r may be freed by its submitter as soon as it is marked done, so
+	 * read everything we need first. */
+	int efd = r->efd;
+	stats_record(HIST_QUEUED, r->submitted);
+	__atomic_store_n(&r->done, true, __ATOMIC_RELEASE);
+	if (efd >= 0)
+		signal_fd(efd);
+}
+
+static void *async_loop(void *arg)
+{
+	struct sched_request **batch =
+		malloc(max_batch * sizeof(struct sched_request *));
+	uint64_t val;
+
+	for (;;) {
+		if (read(wake_fd, &val, sizeof(val)) < 0)
+			continue;
+		bool stopping = !running;
+		struct sched_request *r =
+			__atomic_exchange_n(&pending, NULL, __ATOMIC_ACQUIRE);
+
+		/* The stack holds the newest request first. */
+		struct sched_request *fifo = NULL;
+		while (r != NULL) {
+			struct sched_request *next = r->next;
+			r->next = fifo;
+			fifo = r;
+			r = next;
+		}
+		while (fifo != NULL) {
+			int n = 0;
+			for (; fifo != NULL && n < max_batch; fifo = fifo->next)
+				batch[n++] = fifo;
+			sched_run_batch(batch, n);
+			for (int i = 0; i < n; i++)
+				complete(batch[i]);
+		}
+		if (stopping)
+			break;
+	}
+	free(batch);
+	return NULL;
+}
+
+int sched_async_start(int batch_size)
+{
+	if (running)
+		return -1;
+	wake_fd = eventfd(0, 0);
+	if (wake_fd < 0)
+		return -1;
+	max_batch = batch_size > 0 ? batch_size : 1;
+	running = true;
+	if (pthread_create(&async_thread, NULL, async_loop, NULL) != 0) {
+		running = false;
+		close(wake_fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Stop the scheduler thread once it has run everything queued so far. */
+void sched_async_stop()
+{
+	if (!running)
+		return;
+	running = false;
+	signal_fd(wake_fd);
+	pthread_join(async_thread, NULL);
+	close(wake_fd);
+	wake_fd = -1;
+}
+
+void sched_async_submit(struct sched_request *r)
+{
+	r->done = false;
+	r->submitted = stats_start();
+	struct sched_request *head = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+	do {
+		r->next = head;
+	} while (!__atomic_compare_exchange_n(&pending, &head, r, true,
+	                                      __ATOMIC_RELEASE,
+	                                      __ATOMIC_RELAXED));
+	/* Only the push onto an empty stack needs to wake the scheduler up;
+	 * later ones are picked up along with it. */
+	if (head == NULL)
+		signal_fd(wake_fd);
+}
+
+int sched_async_wait(struct sched_request *r)
+{
+	uint64_t val;
+	while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+		if (r->efd < 0 || read(r->efd, &val, sizeof(val)) < 0)
+			sched_yield();
+	}
+	return r->result;
+}
+
+static void submit(struct sched_request *r, enum sched_op op,
+                   struct proc *p, int arg, int efd)
+{
+	r->op = op;
+	r->p = p;
+	r->arg = arg;
+	r->result = -1;
+	r->efd = efd;
+	sched_async_submit(r);
+}
+
+void sched_async_alloc(struct sched_request *r, struct proc *p, int amt,
+                       int efd)
+{
+	submit(r, SCHED_ALLOC, p, amt, efd);
+}
+
+void sched_async_free(struct sched_request *r, struct proc *p, int core_id,
+                      int efd)
+{
+	submit(r, SCHED_FREE, p, core_id, efd);
+}
+
+void sched_async_provision(struct sched_request *r, struct proc *p,
+                           int core_id, int efd)
+{
+	submit(r, SCHED_PROVISION, p, core_id, efd);
+}
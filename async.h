@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef ASYNC_H_
+#define ASYNC_H_
+
+#include "schedule.h"
+
+/* Start the scheduler thread, which runs queued requests in batches of at
+ * most max_batch. Returns 0 on success. */
+int sched_async_start(int max_batch);
+void sched_async_stop();
+
+/* Queue request r. Any number of threads may submit at once without
+ * taking a lock. r must stay valid until it is done; its efd (or -1) is
+ * signalled once it is. */
+void sched_async_submit(struct sched_request *r);
+
+/* Wait for request r to be done and return its result. An efd should not be
+ * shared by threads waiting at the same time. */
+int sched_async_wait(struct sched_request *r);
+
+/* Helpers filling in and submitting a request. */
+void sched_async_alloc(struct sched_request *r, struct proc *p, int amt,
+                       int efd);
+void sched_async_free(struct sched_request *r, struct proc *p, int core_id,
+                      int efd);
+void sched_async_provision(struct sched_request *r, struct proc *p,
+                           int core_id, int efd);
+
+#endif /* !ASYNC_H_ */
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <numa.h>
+#include "arch.h"
+#include "topology.h"
+#include "schedule.h"
+#include "bandwidth.h"
+
+/* The number of times we run the triad. Like STREAM, we report the best
+ * run, since it is the one least disturbed by the rest of the system. */
+#define BANDWIDTH_REPEATS 5
+
+struct triad_arg {
+	double *a, *b, *c;
+	size_t start, end;
+	int os_core;
+	pthread_barrier_t *barrier;
+};
+
+static void *triad(void *arg)
+{
+	struct triad_arg *t = arg;
+	pin_to_core(t->os_core);
+
+	/* Touch our slice first so page faults are not part of the timing. */
+	for (size_t i = t->start; i < t->end; i++) {
+		t->b[i] = 1.0;
+		t->c[i] = 2.0;
+		t->a[i] = 0.0;
+	}
+	for (int r = 0; r < BANDWIDTH_REPEATS; r++) {
+		pthread_barrier_wait(t->barrier);
+		for (size_t i = t->start; i < t->end; i++)
+			t->a[i] = t->b[i] + 3.0 * t->c[i];
+		pthread_barrier_wait(t->barrier);
+	}
+	return NULL;
+}
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the OS node number of topology NUMA node numa_id, which may
+ * differ from our dense ids, or -1 if none of our cores is on it. */
+static int os_numa_node(int numa_id)
+{
+	struct core_info *cl = cpu_topology_info.core_list;
+	for (int i = 0; i < cpu_topology_info.num_cores; i++)
+		if (cl[i].numa_id == numa_id)
+			return numa_node_of_cpu(cl[i].os_id);
+	return -1;
+}
+
+int measure_numa_bandwidth(int cpu_node, int mem_node, size_t bytes)
+{
+	struct core_info *cl = cpu_topology_info.core_list;
+	int nthreads = 0;
+	for (int i = 0; i < cpu_topology_info.num_cores; i++)
+		if (cl[i].numa_id == cpu_node)
+			nthreads++;
+	int os_node = os_numa_node(mem_node);
+	if (nthreads == 0 || os_node < 0)
+		return 0;
+
+	/* Three arrays of doubles, as in the STREAM triad. */
+	size_t n = bytes / (3 * sizeof(double));
+	double *a = numa_alloc_onnode(n * sizeof(double), os_node);
+	double *b = numa_alloc_onnode(n * sizeof(double), os_node);
+	double *c = numa_alloc_onnode(n * sizeof(double), os_node);
+	if (a == NULL || b == NULL || c == NULL) {
+		if (a != NULL)
+			numa_free(a, n * sizeof(double));
+		if (b != NULL)
+			numa_free(b, n * sizeof(double));
+		if (c != NULL)
+			numa_free(c, n * sizeof(double));
+		return 0;
+	}
+
+	pthread_t threads[nthreads];
+	struct triad_arg args[nthreads];
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (int i = 0, t = 0; i < cpu_topology_info.num_cores; i++) {
+		if (cl[i].numa_id != cpu_node)
+			continue;
+		args[t].a = a;
+		args[t].b = b;
+		args[t].c = c;
+		args[t].start = n * t / nthreads;
+		args[t].end = n * (t + 1) / nthreads;
+		args[t].os_core = cl[i].os_id;
+		args[t].barrier = &barrier;
+		pthread_create(&threads[t], NULL, triad, &args[t]);
+		t++;
+	}
+
+	double best = 0;
+	for (int r = 0; r < BANDWIDTH_REPEATS; r++) {
+		pthread_barrier_wait(&barrier);
+		double start = now_sec();
+		pthread_barrier_wait(&barrier);
+		double elapsed = now_sec() - start;
+		if (best == 0 || elapsed < best)
+			best = elapsed;
+	}
+	for (int t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	numa_free(a, n * sizeof(double));
+	numa_free(b, n * sizeof(double));
+	numa_free(c, n * sizeof(double));
+	return (3 * n * sizeof(double)) / best / (1024 * 1024);
+}
+
+void probe_numa_bandwidth(size_t bytes)
+{
+	int n = cpu_topology_info.num_numa;
+
+	printf("NUMA bandwidth (MB/s), rows: cpu node, columns: memory node\n");
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			int bw = measure_numa_bandwidth(i, j, bytes);
+			if (i == j)
+				set_numa_bandwidth(i, bw);
+			printf("%8d ", bw);
+		}
+		printf("\n");
+	}
+}
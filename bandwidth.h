@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef BANDWIDTH_H_
+#define BANDWIDTH_H_
+
+#include <stddef.h>
+
+/* Measure the sustainable bandwidth (in MB/s) seen by all cores of NUMA node
+ * 'cpu_node' running a STREAM triad over 'bytes' of memory on 'mem_node'.
+ * Both are topology NUMA ids. Returns 0 if the memory cannot be had. */
+int measure_numa_bandwidth(int cpu_node, int mem_node, size_t bytes);
+
+/* Measure the local and remote bandwidth between all pairs of NUMA nodes,
+ * feed the local numbers to the scheduler, and print the full matrix. */
+void probe_numa_bandwidth(size_t bytes);
+
+#endif /* !BANDWIDTH_H_ */
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <numa.h>
+#include "topology.h"
+#include "barrier.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* How long a waiter spins before it starts yielding its core. Barriers with
+ * more participants than cores yield right away, since the participant
+ * they wait for may well need the core. */
+#define BARRIER_SPIN_LIMIT 4096
+
+enum { LEVEL_CPU, LEVEL_SOCKET, LEVEL_NUMA, LEVEL_MACHINE, NUM_LEVELS };
+
+struct barrier_slot {
+	double value;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* A node of the combining tree. Arrivals and releases each get their own
+ * cache line, followed by one line per child for reduction values. */
+struct barrier_node {
+	int count;
+	int expected;
+	struct barrier_node *parent;
+	int parent_slot;
+	int numa_node;
+	size_t size;
+	struct {
+		int sense;
+		double result;
+	} release __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct barrier_slot slots[];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Per participant state, touched only by its own thread. */
+struct barrier_member {
+	struct barrier_node *leaf;
+	int slot;
+	int sense;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct sched_barrier {
+	int n;
+	int spin_limit;
+	int num_nodes;
+	struct barrier_node **nodes;
+	struct barrier_member *members;
+};
+
+/* One entry per node while the tree is built bottom up. */
+struct build_entry {
+	struct barrier_node *node;      /* NULL for a participant */
+	int member;
+	struct core_info *ci;           /* the first core below this entry */
+};
+
+static int level_key(struct core_info *ci, int level)
+{
+	switch (level) {
+	case LEVEL_CPU:
+		return ci->cpu_id;
+	case LEVEL_SOCKET:
+		return ci->socket_id;
+	case LEVEL_NUMA:
+		return ci->numa_id;
+	default:
+		return 0;
+	}
+}
+
+static struct barrier_node *alloc_node(int nchildren, int os_id)
+{
+	size_t size = sizeof(struct barrier_node) +
+	              nchildren * sizeof(struct barrier_slot);
+	int numa_node = numa_available() < 0 ? -1 : numa_node_of_cpu(os_id);
+	struct barrier_node *n;
+
+	if (numa_node >= 0)
+		n = numa_alloc_onnode(size, numa_node);
+	else
+		n = aligned_alloc(CACHE_LINE_SIZE,
+		                  (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+	if (n == NULL)
+		return NULL;
+	memset(n, 0, size);
+	n->expected = nchildren;
+	n->numa_node = numa_node;
+	n->size = size;
+	return n;
+}
+
+static void free_node(struct barrier_node *n)
+{
+	if (n->numa_node >= 0)
+		numa_free(n, n->size);
+	else
+		free(n);
+}
+
+/* Link entry e below node n as its child number slot. */
+static void link_entry(struct sched_barrier *b, struct build_entry *e,
+                       struct barrier_node *n, int slot)
+{
+	if (e->node == NULL) {
+		b->members[e->member].leaf = n;
+		b->members[e->member].slot = slot;
+	} else {
+		e->node->parent = n;
+		e->node->parent_slot = slot;
+	}
+}
+
+struct sched_barrier *sched_barrier_create(const int *os_cores, int n)
+{
+	if (n < 1)
+		return NULL;
+	struct sched_barrier *b = calloc(1, sizeof(struct sched_barrier));
+	if (b == NULL)
+		return NULL;
+	struct build_entry *cur = malloc(n * sizeof(struct build_entry));
+	struct build_entry *next = malloc(n * sizeof(struct build_entry));
+	bool *used = malloc(n * sizeof(bool));
+	b->n = n;
+	b->members = aligned_alloc(CACHE_LINE_SIZE,
+	                           n * sizeof(struct barrier_member));
+	/* A tree over n leaves with at least 2 children per node has fewer
+	 * than n inner nodes; a single participant still gets a root. */
+	b->nodes = malloc(n * sizeof(struct barrier_node *));
+	if (cur == NULL || next == NULL || used == NULL || b->members == NULL ||
+	    b->nodes == NULL)
+		goto fail;
+
+	for (int i = 0; i < n; i++) {
+		cur[i].node = NULL;
+		cur[i].member = i;
+		cur[i].ci = core_of_os_id(os_cores[i]);
+		if (cur[i].ci == NULL)
+			goto fail;
+		b->members[i].sense = 0;
+	}
+	b->spin_limit = BARRIER_SPIN_LIMIT;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < i; j++) {
+			if (os_cores[i] == os_cores[j])
+				b->spin_limit = 0;
+		}
+	}
+
+	/* At each level, group the entries left from the level below by the
+	 * node they share; groups of one are passed up as they are. */
+	int ncur = n;
+	for (int level = LEVEL_CPU; level < NUM_LEVELS; level++) {
+		int nnext = 0;
+		memset(used, 0, ncur * sizeof(bool));
+		for (int i = 0; i < ncur; i++) {
+			if (used[i])
+				continue;
+			int key = level_key(cur[i].ci, level);
+			int nchildren = 0;
+			for (int j = i; j < ncur; j++) {
+				if (!used[j] && level_key(cur[j].ci, level) == key)
+					nchildren++;
+			}
+			if (nchildren == 1 && !(level == LEVEL_MACHINE && ncur == 1 &&
+			                        cur[i].node == NULL)) {
+				used[i] = true;
+				next[nnext++] = cur[i];
+				continue;
+			}
+			struct barrier_node *node = alloc_node(nchildren,
+			                                       cur[i].ci->os_id);
+			if (node == NULL)
+				goto fail;
+			b->nodes[b->num_nodes++] = node;
+			for (int j = i, slot = 0; j < ncur; j++) {
+				if (used[j] || level_key(cur[j].ci, level) != key)
+					continue;
+				used[j] = true;
+				link_entry(b, &cur[j], node, slot++);
+			}
+			next[nnext].node = node;
+			next[nnext].member = -1;
+			next[nnext].ci = cur[i].ci;
+			nnext++;
+		}
+		struct build_entry *tmp = cur;
+		cur = next;
+		next = tmp;
+		ncur = nnext;
+	}
+	free(cur);
+	free(next);
+	free(used);
+	return b;
+
+fail:
+	free(cur);
+	free(next);
+	free(used);
+	sched_barrier_destroy(b);
+	return NULL;
+}
+
+/* Also frees a barrier sched_barrier_create() only partly built. */
+void sched_barrier_destroy(struct sched_barrier *b)
+{
+	if (b == NULL)
+		return;
+	for (int i = 0; b->nodes && i < b->num_nodes; i++)
+		free_node(b->nodes[i]);
+	free(b->nodes);
+	free(b->members);
+	free(b);
+}
+
+static double combine(double a, double b, enum reduce_op op)
+{
+	switch (op) {
+	case REDUCE_MIN:
+		return a < b ? a : b;
+	case REDUCE_MAX:
+		return a > b ? a : b;
+	default:
+		return a + b;
+	}
+}
+
+static double arrive(struct sched_barrier *b, int i, double v,
+                     enum reduce_op op, bool reduce)
+{
+	struct barrier_member *m = &b->members[i];
+	struct barrier_node *won[NUM_LEVELS];
+	int nwon = 0;
+	struct barrier_node *n = m->leaf;
+	int slot = m->slot;
+	int sense = m->sense = !m->sense;
+	double result;
+
+	for (;;) {
+		if (reduce)
+			n->slots[slot].value = v;
+		if (__atomic_add_fetch(&n->count, 1, __ATOMIC_ACQ_REL) ==
+		    n->expected) {
+			/* We are the last one here: combine our children and carry
+			 * the result up on their behalf. Nobody else touches count
+			 * until we release them. */
+			n->count = 0;
+			if (reduce) {
+				v = n->slots[0].value;
+				for (int j = 1; j < n->expected; j++)
+					v = combine(v, n->slots[j].value, op);
+			}
+			won[nwon++] = n;
+			if (n->parent == NULL) {
+				result = v;
+				break;
+			}
+			slot = n->parent_slot;
+			n = n->parent;
+		} else {
+			for (int spins = 0;
+			     __atomic_load_n(&n->release.sense, __ATOMIC_ACQUIRE) !=
+			     sense; spins++) {
+				if (spins >= b->spin_limit)
+					sched_yield();
+				else
+					__builtin_ia32_pause();
+			}
+			result = n->release.result;
+			break;
+		}
+	}
+	/* Release the nodes we won on the way up, from the top down. */
+	while (nwon--) {
+		won[nwon]->release.result = result;
+		__atomic_store_n(&won[nwon]->release.sense, sense, __ATOMIC_RELEASE);
+	}
+	return result;
+}
+
+void sched_barrier_wait(struct sched_barrier *b, int i)
+{
+	arrive(b, i, 0, REDUCE_SUM, false);
+}
+
+double sched_allreduce(struct sched_barrier *b, int i, double v,
+                       enum reduce_op op)
+{
+	return arrive(b, i, v, op, true);
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef BARRIER_H_
+#define BARRIER_H_
+
+enum reduce_op { REDUCE_SUM, REDUCE_MIN, REDUCE_MAX };
+
+struct sched_barrier;
+
+/* Create a barrier for n participants, participant i running on OS core
+ * os_cores[i]. Arrivals are combined first within a cpu, then within a
+ * socket, then within a NUMA node, and only then across the machine. Each
+ * level waits on its own cache lines, allocated on the memory of the NUMA
+ * node the level lives in. Returns NULL on failure. */
+struct sched_barrier *sched_barrier_create(const int *os_cores, int n);
+void sched_barrier_destroy(struct sched_barrier *b);
+
+/* Wait until all participants reached the barrier. Participant i must be
+ * the only caller passing i. */
+void sched_barrier_wait(struct sched_barrier *b, int i);
+
+/* Combine value v of every participant with op and return the result to
+ * all of them, which also acts as a barrier. The combining order is fixed
+ * by the tree, so all participants get bitwise identical results. */
+double sched_allreduce(struct sched_barrier *b, int i, double v,
+                       enum reduce_op op);
+
+#endif /* !BARRIER_H_ */
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* schedbench times the synchronization primitives built on the core tree
+ * against their flat pthread counterparts, at a growing number of threads.
+ * Barrier threads are pinned round robin over the cores in topology order.
+ * Lock and counter threads are dealt out across sockets first, so that
+ * even two of them contend across the interconnect. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "arch.h"
+#include "acpi.h"
+#include "topology.h"
+#include "barrier.h"
+#include "cohort.h"
+#include "shard.h"
+
+enum bench_kind {
+	BENCH_PTHREAD, BENCH_TREE, BENCH_ALLREDUCE,
+	BENCH_MUTEX, BENCH_MCS, BENCH_COHORT,
+	BENCH_ATOMIC, BENCH_SOCKET_COUNTER, BENCH_CORE_COUNTER,
+	NUM_BENCHES
+};
+#define FIRST_LOCK_BENCH BENCH_MUTEX
+#define FIRST_COUNTER_BENCH BENCH_ATOMIC
+static const char *bench_label[NUM_BENCHES] = {
+	"pthread_barrier", "tree_barrier", "tree_allreduce",
+	"pthread_mutex", "mcs_lock", "cohort_lock",
+	"atomic_add", "socket_counter", "core_counter"
+};
+
+/* The data guarded by the locks: a counter plus a few more cache lines
+ * that have to follow the lock from core to core. */
+#define SHARED_LINES 4
+struct shared_data {
+	unsigned long count;
+	unsigned long lines[SHARED_LINES][8];
+} __attribute__((aligned(64)));
+
+struct bench_arg {
+	int id;
+	int os_core;
+	int iters;
+	enum bench_kind kind;
+	pthread_barrier_t *pbarrier;
+	struct sched_barrier *tbarrier;
+	pthread_mutex_t *mutex;
+	struct mcs_lock *mcs;
+	struct cohort_lock *cohort;
+	struct shard_counter *counter;
+	struct shared_data *shared;
+	double result;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void critical_section(struct shared_data *d)
+{
+	d->count++;
+	for (int i = 0; i < SHARED_LINES; i++)
+		d->lines[i][0]++;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_arg *a = arg;
+	struct mcs_node node;
+	double sum = 0;
+
+	pin_to_core(a->os_core);
+	for (int i = 0; i < a->iters; i++) {
+		switch (a->kind) {
+		case BENCH_PTHREAD:
+			pthread_barrier_wait(a->pbarrier);
+			break;
+		case BENCH_TREE:
+			sched_barrier_wait(a->tbarrier, a->id);
+			break;
+		case BENCH_ALLREDUCE:
+			sum += sched_allreduce(a->tbarrier, a->id, a->id, REDUCE_SUM);
+			break;
+		case BENCH_MUTEX:
+			pthread_mutex_lock(a->mutex);
+			critical_section(a->shared);
+			pthread_mutex_unlock(a->mutex);
+			break;
+		case BENCH_MCS:
+			mcs_lock(a->mcs, &node);
+			critical_section(a->shared);
+			mcs_unlock(a->mcs, &node);
+			break;
+		case BENCH_COHORT:
+			cohort_lock(a->cohort);
+			critical_section(a->shared);
+			cohort_unlock(a->cohort);
+			break;
+		case BENCH_ATOMIC:
+			__atomic_fetch_add(&a->shared->count, 1, __ATOMIC_RELAXED);
+			break;
+		case BENCH_SOCKET_COUNTER:
+		case BENCH_CORE_COUNTER:
+			shard_counter_add(a->counter, 1);
+			break;
+		default:
+			break;
+		}
+	}
+	a->result = sum;
+	return NULL;
+}
+
+/* The cores in an order that alternates between sockets: the first core
+ * of every socket, then the second one of every socket, and so on. */
+static int *socket_interleaved_cores()
+{
+	int n = cpu_topology_info.num_cores;
+	struct core_info *cores = cpu_topology_info.core_list;
+	int *order = malloc(n * sizeof(int));
+	int *next = calloc(cpu_topology_info.num_sockets, sizeof(int));
+	int *first = malloc(cpu_topology_info.num_sockets * sizeof(int));
+
+	for (int i = n - 1; i >= 0; i--)
+		first[cores[i].socket_id] = i;
+	for (int i = 0; i < n;) {
+		for (int s = 0; s < cpu_topology_info.num_sockets; s++) {
+			int c = first[s] + next[s];
+			if (c < n && cores[c].socket_id == s) {
+				order[i++] = cores[c].os_id;
+				next[s]++;
+			}
+		}
+	}
+	free(first);
+	free(next);
+	return order;
+}
+
+/* Run 'iters' rounds of a primitive over nthreads threads and return the
+ * average time of a round, in ns. For the locks, a round is a single
+ * acquisition by a single thread. For the counters, it is one increment
+ * by every thread at once. */
+static double run_bench(enum bench_kind kind, int nthreads, int iters)
+{
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	struct bench_arg *args = malloc(nthreads * sizeof(struct bench_arg));
+	int *os_cores = malloc(nthreads * sizeof(int));
+	int *lock_cores = socket_interleaved_cores();
+	pthread_barrier_t pbarrier;
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	struct mcs_lock mcs = MCS_LOCK_INITIALIZER;
+	struct cohort_lock *cohort = cohort_lock_create(COHORT_SOCKET, 0);
+	struct shard_counter *counter = shard_counter_create(
+		kind == BENCH_SOCKET_COUNTER ? SOCKET : CORE);
+	struct shared_data *shared = aligned_alloc(64, sizeof(*shared));
+
+	memset(shared, 0, sizeof(*shared));
+	for (int i = 0; i < nthreads; i++) {
+		int core = i % cpu_topology_info.num_cores;
+		if (kind >= FIRST_LOCK_BENCH)
+			os_cores[i] = lock_cores[core];
+		else
+			os_cores[i] = cpu_topology_info.core_list[core].os_id;
+	}
+	pthread_barrier_init(&pbarrier, NULL, nthreads);
+	struct sched_barrier *tbarrier = sched_barrier_create(os_cores, nthreads);
+	if (tbarrier == NULL) {
+		fprintf(stderr, "could not build a barrier over %d threads\n",
+		        nthreads);
+		exit(-1);
+	}
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < nthreads; i++) {
+		args[i] = (struct bench_arg) {
+			.id = i,
+			.os_core = os_cores[i],
+			.iters = iters,
+			.kind = kind,
+			.pbarrier = &pbarrier,
+			.tbarrier = tbarrier,
+			.mutex = &mutex,
+			.mcs = &mcs,
+			.cohort = cohort,
+			.counter = counter,
+			.shared = shared,
+		};
+		pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+	}
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	uint64_t ns = now_ns() - start;
+
+	/* Every participant must see the same sum of all ids. */
+	double expect = (double)nthreads * (nthreads - 1) / 2 * iters;
+	for (int i = 0; kind == BENCH_ALLREDUCE && i < nthreads; i++) {
+		if (args[i].result != expect) {
+			fprintf(stderr, "allreduce mismatch on thread %d: %f != %f\n",
+			        i, args[i].result, expect);
+			exit(-1);
+		}
+	}
+	unsigned long count = shared->count;
+	if (kind == BENCH_SOCKET_COUNTER || kind == BENCH_CORE_COUNTER)
+		count = shard_counter_read(counter);
+	if (kind >= FIRST_LOCK_BENCH &&
+	    count != (unsigned long)nthreads * iters) {
+		fprintf(stderr, "%s lost updates: %lu != %lu\n", bench_label[kind],
+		        count, (unsigned long)nthreads * iters);
+		exit(-1);
+	}
+	if (kind >= FIRST_LOCK_BENCH && kind < FIRST_COUNTER_BENCH)
+		ns /= nthreads;
+
+	free(shared);
+	shard_counter_destroy(counter);
+	cohort_lock_destroy(cohort);
+	pthread_mutex_destroy(&mutex);
+	sched_barrier_destroy(tbarrier);
+	pthread_barrier_destroy(&pbarrier);
+	free(lock_cores);
+	free(os_cores);
+	free(args);
+	free(threads);
+	return (double)ns / iters;
+}
+
+/* Time benchmarks [first, last) at every thread count, one per column. */
+static void print_table(int first, int last, const char *unit,
+                        int max_threads, int iters)
+{
+	printf("%8s", "threads");
+	for (int k = first; k < last; k++)
+		printf(" %16s", bench_label[k]);
+	printf("   (%s)\n", unit);
+	for (int t = 2; t <= max_threads; t *= 2) {
+		printf("%8d", t);
+		for (int k = first; k < last; k++) {
+			/* Oversubscribed runs are slow; keep them short. */
+			int n = t > cpu_topology_info.num_cores ?
+			        iters * cpu_topology_info.num_cores / t + 1 : iters;
+			printf(" %16.0f", run_bench(k, t, n));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s [-t max_threads] [-n iterations]\n"
+	        "  -t  double the thread count from 2 up to max_threads "
+	        "(default 512)\n"
+	        "  -n  rounds timed at each thread count (default 10000)\n",
+	        prog);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = 512, iters = 10000, opt;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 2 || iters < 1)
+		usage(argv[0]);
+
+	acpiinit();
+	topology_init();
+
+	print_table(0, FIRST_LOCK_BENCH, "ns per round", max_threads, iters);
+	printf("\n");
+	print_table(FIRST_LOCK_BENCH, FIRST_COUNTER_BENCH, "ns per acquisition",
+	            max_threads, iters);
+	printf("\n");
+	print_table(FIRST_COUNTER_BENCH, NUM_BENCHES, "ns per round",
+	            max_threads, iters);
+	return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <numa.h>
+#include "topology.h"
+#include "cohort.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* How long a waiter spins before it starts yielding its core to whoever it
+ * waits for, which matters as soon as there are more threads than cores. */
+#define COHORT_SPIN_LIMIT 1024
+
+/* The lock local to one socket or NUMA node. It is a ticket lock, so waiters
+ * of the same cohort are served in FIFO order. Besides the tickets, the
+ * fields are only touched by the current holder. */
+struct cohort_local {
+	unsigned int next;
+	unsigned int owner;
+	bool global_held;
+	int passes;
+	unsigned long nr_passes;
+	unsigned long nr_acquires;
+	int numa_node;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct cohort_lock {
+	struct {
+		unsigned int next;
+		unsigned int owner;
+	} global __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct {
+		int cohort;
+	} holder __attribute__((aligned(CACHE_LINE_SIZE)));
+	enum cohort_level level;
+	int max_passes;
+	int num_cohorts;
+	struct cohort_local *locals[];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static void spin_until(unsigned int *word, unsigned int val)
+{
+	int spins = 0;
+	while (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val) {
+		if (++spins < COHORT_SPIN_LIMIT)
+			__builtin_ia32_pause();
+		else
+			sched_yield();
+	}
+}
+
+static int cohort_of(struct cohort_lock *l, struct core_info *c)
+{
+	return l->level == COHORT_SOCKET ? c->socket_id : c->numa_id;
+}
+
+static struct cohort_local *alloc_local(int os_id)
+{
+	int numa_node = numa_available() < 0 ? -1 : numa_node_of_cpu(os_id);
+	struct cohort_local *local;
+
+	if (numa_node >= 0)
+		local = numa_alloc_onnode(sizeof(struct cohort_local), numa_node);
+	else
+		local = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct cohort_local));
+	if (local == NULL)
+		return NULL;
+	memset(local, 0, sizeof(struct cohort_local));
+	local->numa_node = numa_node;
+	return local;
+}
+
+static void free_local(struct cohort_local *local)
+{
+	if (local->numa_node >= 0)
+		numa_free(local, sizeof(struct cohort_local));
+	else
+		free(local);
+}
+
+struct cohort_lock *cohort_lock_create(enum cohort_level level,
+                                       int max_passes)
+{
+	int n = level == COHORT_SOCKET ? cpu_topology_info.num_sockets
+	                               : cpu_topology_info.num_numa;
+	size_t size = sizeof(struct cohort_lock) +
+	              n * sizeof(struct cohort_local *);
+	struct cohort_lock *l = aligned_alloc(CACHE_LINE_SIZE,
+		(size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+
+	if (l == NULL)
+		return NULL;
+	memset(l, 0, size);
+	l->level = level;
+	l->max_passes = max_passes > 0 ? max_passes : COHORT_MAX_PASSES;
+	l->num_cohorts = n;
+
+	/* Place each local lock on the memory of its own cohort. */
+	for (int i = 0; i < cpu_topology_info.num_cores; i++) {
+		struct core_info *c = &cpu_topology_info.core_list[i];
+		int cohort = cohort_of(l, c);
+		if (l->locals[cohort] != NULL)
+			continue;
+		l->locals[cohort] = alloc_local(c->os_id);
+		if (l->locals[cohort] == NULL) {
+			cohort_lock_destroy(l);
+			return NULL;
+		}
+	}
+	return l;
+}
+
+void cohort_lock_destroy(struct cohort_lock *l)
+{
+	for (int i = 0; i < l->num_cohorts; i++) {
+		if (l->locals[i] != NULL)
+			free_local(l->locals[i]);
+	}
+	free(l);
+}
+
+void cohort_lock(struct cohort_lock *l)
+{
+	/* Threads on cores outside our topology queue in the first cohort. */
+	struct core_info *c = current_core();
+	int cohort = c ? cohort_of(l, c) : 0;
+	struct cohort_local *local = l->locals[cohort];
+
+	unsigned int ticket = __atomic_fetch_add(&local->next, 1,
+	                                         __ATOMIC_RELAXED);
+	spin_until(&local->owner, ticket);
+
+	/* The previous holder of our local lock may have passed us the global
+	 * lock along with it. */
+	if (local->global_held) {
+		local->nr_passes++;
+	} else {
+		ticket = __atomic_fetch_add(&l->global.next, 1, __ATOMIC_RELAXED);
+		spin_until(&l->global.owner, ticket);
+		local->nr_acquires++;
+	}
+	/* We may migrate before unlocking, so remember which cohort we hold. */
+	l->holder.cohort = cohort;
+}
+
+void cohort_unlock(struct cohort_lock *l)
+{
+	struct cohort_local *local = l->locals[l->holder.cohort];
+	unsigned int owner = local->owner;
+	bool waiters = __atomic_load_n(&local->next, __ATOMIC_RELAXED) !=
+	               owner + 1;
+
+	/* Keep the global lock within the cohort while someone there waits,
+	 * but no more than max_passes times in a row, so that cohorts queued on
+	 * the global lock get their turn. */
+	if (waiters && local->passes < l->max_passes) {
+		local->global_held = true;
+		local->passes++;
+	} else {
+		local->global_held = false;
+		local->passes = 0;
+		__atomic_store_n(&l->global.owner, l->global.owner + 1,
+		                 __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&local->owner, owner + 1, __ATOMIC_RELEASE);
+}
+
+void cohort_lock_stats(struct cohort_lock *l, unsigned long *passes,
+                       unsigned long *acquires)
+{
+	*passes = *acquires = 0;
+	for (int i = 0; i < l->num_cohorts; i++) {
+		*passes += l->locals[i]->nr_passes;
+		*acquires += l->locals[i]->nr_acquires;
+	}
+}
+
+void mcs_lock(struct mcs_lock *l, struct mcs_node *node)
+{
+	node->next = NULL;
+	node->locked = true;
+	struct mcs_node *prev = __atomic_exchange_n(&l->tail, node,
+	                                            __ATOMIC_ACQ_REL);
+	if (prev == NULL)
+		return;
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+	int spins = 0;
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+		if (++spins < COHORT_SPIN_LIMIT)
+			__builtin_ia32_pause();
+		else
+			sched_yield();
+	}
+}
+
+void mcs_unlock(struct mcs_lock *l, struct mcs_node *node)
+{
+	struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (next == NULL) {
+		struct mcs_node *expected = node;
+		if (__atomic_compare_exchange_n(&l->tail, &expected, NULL, false,
+		                                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		/* A successor swapped itself in but has not linked up yet. */
+		while ((next = __atomic_load_n(&node->next,
+		                               __ATOMIC_ACQUIRE)) == NULL)
+			__builtin_ia32_pause();
+	}
+	__atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef COHORT_H_
+#define COHORT_H_
+
+#include <stdbool.h>
+
+/* How many times in a row a cohort lock may be handed to a waiter of the
+ * same cohort before it has to go back to the global lock. */
+#define COHORT_MAX_PASSES 64
+
+enum cohort_level { COHORT_SOCKET, COHORT_NUMA };
+
+struct cohort_lock;
+
+/* Create a lock whose waiters are grouped by the socket or NUMA node of the
+ * core they run on. A release hands the lock to a waiter of its own cohort
+ * while there is one, up to max_passes times in a row (0 for the default),
+ * and otherwise through a FIFO global lock to the next cohort. Returns NULL
+ * on failure. Must be called after the topology is initialized. */
+struct cohort_lock *cohort_lock_create(enum cohort_level level,
+                                       int max_passes);
+void cohort_lock_destroy(struct cohort_lock *l);
+void cohort_lock(struct cohort_lock *l);
+void cohort_unlock(struct cohort_lock *l);
+
+/* Local handoffs and global acquisitions since the lock was created. */
+void cohort_lock_stats(struct cohort_lock *l, unsigned long *passes,
+                       unsigned long *acquires);
+
+/* A plain MCS queue lock. Each waiter spins on its own node, which must
+ * stay valid until mcs_unlock() returns. */
+struct mcs_node {
+	struct mcs_node *next;
+	bool locked;
+} __attribute__((aligned(64)));
+
+struct mcs_lock {
+	struct mcs_node *tail;
+};
+
+#define MCS_LOCK_INITIALIZER { NULL }
+
+void mcs_lock(struct mcs_lock *l, struct mcs_node *node);
+void mcs_unlock(struct mcs_lock *l, struct mcs_node *node);
+
+#endif /* !COHORT_H_ */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include "freq.h"
+
+struct core_freq core_freq_list[CPU_SETSIZE];
+
+static int read_khz(const char *root, int os_id, const char *name)
+{
+	char path[4096];
+	int khz = 0;
+
+	snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/%s", root, os_id, name);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%d", &khz) != 1)
+		khz = 0;
+	fclose(f);
+	return khz;
+}
+
+int freq_init(const char *root)
+{
+	int found = 0;
+
+	if (root == NULL)
+		root = FREQ_SYSFS_ROOT;
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		struct core_freq *f = &core_freq_list[i];
+		f->max_khz = read_khz(root, i, "cpuinfo_max_freq");
+		if (f->max_khz == 0)
+			continue;
+		/* Only intel_pstate tells us the base clock; without it, we have
+		 * no idea how much of max is turbo, and assume none is. */
+		f->base_khz = read_khz(root, i, "base_frequency");
+		if (f->base_khz == 0 || f->base_khz > f->max_khz)
+			f->base_khz = f->max_khz;
+		f->cur_khz = read_khz(root, i, "scaling_cur_freq");
+		found++;
+	}
+	return found;
+}
+
+void set_core_freq(int os_id, int max_khz, int base_khz)
+{
+	if (os_id < 0 || os_id >= CPU_SETSIZE)
+		return;
+	core_freq_list[os_id].max_khz = max_khz;
+	core_freq_list[os_id].base_khz = base_khz < max_khz ? base_khz : max_khz;
+	core_freq_list[os_id].cur_khz = 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef FREQ_H_
+#define FREQ_H_
+
+#include <sched.h>
+
+#define FREQ_SYSFS_ROOT "/sys/devices/system/cpu"
+
+/* The clocks of an OS core, in kHz, or 0 when unknown. max is the highest
+ * turbo clock with a single busy core, base the guaranteed all-core one. */
+struct core_freq {
+	int max_khz;
+	int base_khz;
+	int cur_khz;
+};
+
+extern struct core_freq core_freq_list[CPU_SETSIZE];
+
+/* Read the clocks of every core below root (FREQ_SYSFS_ROOT if NULL), as
+ * laid out by cpufreq. Call again to refresh the current clocks. Returns
+ * the number of cores found. */
+int freq_init(const char *root);
+
+/* Set the clocks of a core, for tests and simulations. */
+void set_core_freq(int os_id, int max_khz, int base_khz);
+
+#endif /* !FREQ_H_ */
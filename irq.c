@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "irq.h"
+
+/* The most IRQs we steer for a single device. */
+#define MAX_DEVICE_IRQS 256
+
+static inline bool is_name_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+/* Returns whether tok appears in s as a whole token, i.e. not next to any
+ * other letter, digit or '_'. */
+static bool has_token(const char *s, const char *tok)
+{
+	size_t len = strlen(tok);
+	if (len == 0)
+		return false;
+	for (const char *t = strstr(s, tok); t; t = strstr(t + 1, tok)) {
+		if ((t == s || !is_name_char(t[-1])) && !is_name_char(t[len]))
+			return true;
+	}
+	return false;
+}
+
+/* Read a hex field of at most max, 'digits' digits long at most, at *s. */
+static bool read_hex(const char **s, int digits, unsigned long max,
+                     unsigned long *val)
+{
+	int n = 0;
+	*val = 0;
+	for (; n < digits && isxdigit((unsigned char)**s); n++, (*s)++)
+		*val = *val * 16 + (isdigit((unsigned char)**s) ? **s - '0' :
+		                    tolower((unsigned char)**s) - 'a' + 10);
+	return n > 0 && *val <= max;
+}
+
+/* Parse the PCI address at s, as domain:bus:dev.fn or as bus:dev.fn in
+ * domain 0, into *addr. Returns the number of characters it takes, or 0 if
+ * s does not start with a whole PCI address. */
+static int parse_pci_addr(const char *s, unsigned long *addr)
+{
+	const char *p = s;
+	unsigned long f[4], dom = 0;
+	int nf = 0;
+
+	if (!read_hex(&p, 4, 0xffff, &f[nf++]) || *p++ != ':' ||
+	    !read_hex(&p, 2, 0xff, &f[nf++]))
+		return 0;
+	if (*p == ':') {
+		p++;
+		if (!read_hex(&p, 2, 0xff, &f[nf++]))
+			return 0;
+	}
+	if (*p++ != '.' || !read_hex(&p, 1, 7, &f[nf]))
+		return 0;
+	if (is_name_char(*p) || *p == ':' || *p == '.')
+		return 0;
+	if (nf == 3) {
+		dom = f[0];
+		memmove(f, f + 1, 3 * sizeof(f[0]));
+	}
+	if (f[0] > 0xff || f[1] > 0x1f)
+		return 0;
+	*addr = dom << 16 | f[0] << 8 | f[1] << 3 | f[2];
+	return p - s;
+}
+
+/* Returns whether a PCI address equal to addr appears in s. Addresses
+ * without a domain are in domain 0, so "03:00.0" and "0000:03:00.0" are the
+ * same device, but neither is "0001:03:00.0". */
+static bool has_pci_addr(const char *s, unsigned long addr)
+{
+	unsigned long a;
+	for (const char *t = s; *t; t++) {
+		/* Only try where an address may start: not in the middle of a
+		 * hex number, nor after the domain or bus of a longer address. */
+		if (t > s && (isxdigit((unsigned char)t[-1]) || t[-1] == '.' ||
+		              (t[-1] == ':' && t - 1 > s &&
+		               isxdigit((unsigned char)t[-2]))))
+			continue;
+		if (parse_pci_addr(t, &a) && a == addr)
+			return true;
+	}
+	return false;
+}
+
+int find_irqs(const char *proc_root, const char *match, int *irqs, int max)
+{
+	char path[4096], line[8192];
+
+	if (proc_root == NULL)
+		proc_root = IRQ_PROC_ROOT;
+	snprintf(path, sizeof(path), "%s/interrupts", proc_root);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	/* PCI addresses are compared in their full form, other names as
+	 * tokens. */
+	unsigned long addr;
+	int len = parse_pci_addr(match, &addr);
+	bool is_addr = len > 0 && match[len] == '\0';
+
+	int n = 0;
+	while (n < max && fgets(line, sizeof(line), f)) {
+		/* Skip the cpu header and the named architecture IRQs (NMI, LOC,
+		 * ...), which cannot be steered. */
+		char *s = line;
+		while (isspace(*s))
+			s++;
+		if (!isdigit(*s))
+			continue;
+		char *end;
+		long irq = strtol(s, &end, 10);
+		if (*end != ':')
+			continue;
+		/* The names of the IRQ's actions close the line, after two
+		 * spaces and separated by ", ". Only they may match, not the chip
+		 * and trigger fields. IRQs without actions end with the padding of
+		 * those fields, leaving no name to match. */
+		end[strcspn(end, "\n")] = '\0';
+		char *actions = NULL;
+		for (char *t = strstr(end, "  "); t; t = strstr(t + 1, "  "))
+			actions = t + 2;
+		if (actions && (is_addr ? has_pci_addr(actions, addr) :
+		                           has_token(actions, match)))
+			irqs[n++] = irq;
+	}
+	fclose(f);
+	return n;
+}
+
+void format_cpumask(const cpu_set_t *cpus, char *buf, size_t len)
+{
+	int top = 0;
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, cpus))
+			top = i;
+	}
+
+	size_t off = 0;
+	buf[0] = '\0';
+	for (int w = top / 32; w >= 0 && off < len; w--) {
+		unsigned int word = 0;
+		for (int b = 0; b < 32; b++) {
+			if (CPU_ISSET(w * 32 + b, cpus))
+				word |= 1u << b;
+		}
+		off += snprintf(buf + off, len - off, w ? "%08x," : "%08x", word);
+	}
+}
+
+int write_irq_affinity(const char *proc_root, int irq, const cpu_set_t *cpus)
+{
+	char path[4096], mask[CPU_SETSIZE / 4 + CPU_SETSIZE / 32 + 1];
+
+	if (proc_root == NULL)
+		proc_root = IRQ_PROC_ROOT;
+	snprintf(path, sizeof(path), "%s/irq/%d/smp_affinity", proc_root, irq);
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	format_cpumask(cpus, mask, sizeof(mask));
+	int ret = fprintf(f, "%s\n", mask) < 0 ? -1 : 0;
+	if (fclose(f) != 0)
+		ret = -1;
+	return ret;
+}
+
+int plan_irqs(struct proc *p, const char *proc_root, const char *match,
+              bool avoid_siblings, bool apply)
+{
+	int irqs[MAX_DEVICE_IRQS], os_cores[MAX_DEVICE_IRQS];
+	char mask[CPU_SETSIZE / 4 + CPU_SETSIZE / 32 + 1];
+
+	int nirqs = find_irqs(proc_root, match, irqs, MAX_DEVICE_IRQS);
+	if (nirqs <= 0)
+		return nirqs;
+	if (sched_plan_irqs(p, nirqs, avoid_siblings, os_cores) < 0)
+		return -1;
+
+	int ret = nirqs;
+	for (int i = 0; i < nirqs; i++) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(os_cores[i], &cpus);
+		if (apply) {
+			if (write_irq_affinity(proc_root, irqs[i], &cpus) != 0)
+				ret = -1;
+		} else {
+			format_cpumask(&cpus, mask, sizeof(mask));
+			printf("irq %4d -> core %3d smp_affinity %s\n", irqs[i],
+			       os_cores[i], mask);
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef IRQ_H_
+#define IRQ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sched.h>
+#include "schedule.h"
+
+#define IRQ_PROC_ROOT "/proc"
+
+/* Fill irqs with up to max IRQ numbers with an action whose name holds match
+ * (a PCI device, driver or interface name) as a whole token: "eth1" matches
+ * "eth1-TxRx-0" but not "eth10". PCI addresses are compared in full, with
+ * domain 0 when it is left out: "03:00.0" matches "0000:03:00.0" but not
+ * "0001:03:00.0". Returns the number of IRQs found, or -1 if
+ * proc_root/interrupts cannot be read. */
+int find_irqs(const char *proc_root, const char *match, int *irqs, int max);
+
+/* Format cpus the way smp_affinity expects: comma separated 32 bit hex
+ * words, most significant first. */
+void format_cpumask(const cpu_set_t *cpus, char *buf, size_t len);
+
+int write_irq_affinity(const char *proc_root, int irq, const cpu_set_t *cpus);
+
+/* Steer the IRQs matching 'match' to cores near proc p, as planned by
+ * sched_plan_irqs(). The masks are written to proc_root if 'apply' is set,
+ * and printed otherwise. Returns the number of IRQs planned, or -1. */
+int plan_irqs(struct proc *p, const char *proc_root, const char *match,
+              bool avoid_siblings, bool apply);
+
+#endif /* !IRQ_H_ */
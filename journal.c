@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+bool journal_enabled;
+uint64_t journal_seq;
+
+static int journal_fd = -1;
+static bool journal_sync;
+
+static int write_header(int fd)
+{
+	struct journal_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+	h.version = 1;
+	h.record_size = sizeof(struct journal_record);
+	return write(fd, &h, sizeof(h)) == sizeof(h) ? 0 : -1;
+}
+
+static int read_header(FILE *f)
+{
+	struct journal_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+	    memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 ||
+	    h.record_size != sizeof(struct journal_record))
+		return -1;
+	return 0;
+}
+
+void journal_append(enum journal_op op, uint32_t pid, int arg)
+{
+	struct journal_record r = {
+		.seq = ++journal_seq,
+		.pid = pid,
+		.arg = arg,
+		.op = op,
+	};
+	/* A record that cannot be written leaves a gap that replay would not
+	 * notice, so stop journaling: the next checkpoint is the only way back
+	 * to a consistent state. */
+	if (write(journal_fd, &r, sizeof(r)) != sizeof(r)) {
+		journal_enabled = false;
+		return;
+	}
+	if (journal_sync)
+		fdatasync(journal_fd);
+}
+
+int journal_start(const char *path, bool sync)
+{
+	struct stat st;
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0)
+		goto fail;
+	if (st.st_size == 0) {
+		if (write_header(fd) != 0)
+			goto fail;
+	} else {
+		/* Carry on from the last complete record, dropping a torn one. */
+		off_t hdr = sizeof(struct journal_header);
+		off_t rec = sizeof(struct journal_record);
+		off_t end = st.st_size < hdr ? hdr :
+		            hdr + (st.st_size - hdr) / rec * rec;
+		if (journal_replay(path, UINT64_MAX, NULL, NULL) < 0 ||
+		    ftruncate(fd, end) != 0)
+			goto fail;
+	}
+	journal_fd = fd;
+	journal_sync = sync;
+	journal_enabled = true;
+	return 0;
+fail:
+	close(fd);
+	return -1;
+}
+
+void journal_stop()
+{
+	if (journal_fd < 0)
+		return;
+	journal_enabled = false;
+	close(journal_fd);
+	journal_fd = -1;
+}
+
+int journal_reset()
+{
+	if (journal_fd < 0)
+		return -1;
+	if (ftruncate(journal_fd, 0) != 0 || write_header(journal_fd) != 0)
+		return -1;
+	if (journal_sync)
+		fdatasync(journal_fd);
+	return 0;
+}
+
+int journal_replay(const char *path, uint64_t after,
+                   void (*apply)(struct journal_record *r, void *arg),
+                   void *arg)
+{
+	struct journal_record r;
+	int n = 0;
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (read_header(f) != 0) {
+		fclose(f);
+		return -1;
+	}
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		if (r.seq > journal_seq)
+			journal_seq = r.seq;
+		if (r.seq <= after || r.op >= NUM_JOURNAL_OPS)
+			continue;
+		apply(&r, arg);
+		n++;
+	}
+	fclose(f);
+	return n;
+}
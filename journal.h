@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum journal_op {
+	JOURNAL_ALLOC,          /* arg: core id */
+	JOURNAL_FREE,           /* arg: core id */
+	JOURNAL_PROVISION,      /* arg: core id */
+	JOURNAL_DEPROVISION,    /* arg: core id */
+	JOURNAL_CLASS,          /* arg: core class */
+	JOURNAL_BANDWIDTH,      /* arg: MB/s per core */
+	NUM_JOURNAL_OPS
+};
+
+/* One change to the allocator state. Sequence numbers grow by one with
+ * every record, and carry on across checkpoints. */
+struct journal_record {
+	uint64_t seq;
+	uint32_t pid;
+	int32_t arg;
+	uint32_t op;
+	uint32_t pad;
+};
+
+/* A journal file is a journal_header followed by journal_records in
+ * sequence order. */
+#define JOURNAL_MAGIC "SCHEDJNL"
+struct journal_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+extern bool journal_enabled;
+extern uint64_t journal_seq;
+void journal_append(enum journal_op op, uint32_t pid, int arg);
+
+/* Log a change before it is made visible to anyone. Callers serialize. */
+static inline void journal_record(enum journal_op op, uint32_t pid, int arg)
+{
+	if (journal_enabled)
+		journal_append(op, pid, arg);
+}
+
+/* Append changes to the journal at 'path', continuing its sequence if it
+ * already holds records. Records go to the kernel as they are made, so a
+ * crash of the process loses none of them; 'sync' also flushes them to
+ * disk, to survive a crash of the machine. Returns 0 on success. */
+int journal_start(const char *path, bool sync);
+void journal_stop();
+
+/* Drop every record, once a checkpoint covers them. */
+int journal_reset();
+
+/* Call 'apply' on each record of the journal at 'path' with a sequence
+ * number above 'after', in order, and move journal_seq past the last one.
+ * Returns the number of records applied, or -1 if the file is not a
+ * journal. A truncated last record is ignored. */
+int journal_replay(const char *path, uint64_t after,
+                   void (*apply)(struct journal_record *r, void *arg),
+                   void *arg);
+
+#endif /* !JOURNAL_H_ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "arch.h"
+#include "latency.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* The cache line we bounce between the two cores. The ping side writes an
+ * odd value, the pong side answers with the next even value. */
+struct pingpong_line {
+	volatile uint32_t flag;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct pingpong_arg {
+	struct pingpong_line *line;
+	int os_core;
+	int iterations;
+};
+
+static void *pong(void *arg)
+{
+	struct pingpong_arg *pp = arg;
+	pin_to_core(pp->os_core);
+
+	for (uint32_t i = 0; i < pp->iterations; i++) {
+		while (__atomic_load_n(&pp->line->flag, __ATOMIC_ACQUIRE) != 2*i + 1)
+			__builtin_ia32_pause();
+		__atomic_store_n(&pp->line->flag, 2*i + 2, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *ping(void *arg)
+{
+	struct pingpong_arg *pp = arg;
+	pin_to_core(pp->os_core);
+
+	/* The first quarter of the round trips warms up the line and the pong
+	 * thread, and is not timed. */
+	uint64_t start = 0;
+	for (uint32_t i = 0; i < pp->iterations; i++) {
+		if (i == pp->iterations / 4)
+			start = now_ns();
+		__atomic_store_n(&pp->line->flag, 2*i + 1, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&pp->line->flag, __ATOMIC_ACQUIRE) != 2*i + 2)
+			__builtin_ia32_pause();
+	}
+	return (void*)(long)(now_ns() - start);
+}
+
+int measure_core_latency(int os_core_a, int os_core_b, int iterations)
+{
+	struct pingpong_line line = { 0 };
+	pthread_t ping_thread, pong_thread;
+	void *elapsed;
+
+	if (iterations < 4)
+		iterations = 4;
+	struct pingpong_arg a = { &line, os_core_a, iterations };
+	struct pingpong_arg b = { &line, os_core_b, iterations };
+
+	pthread_create(&pong_thread, NULL, pong, &b);
+	pthread_create(&ping_thread, NULL, ping, &a);
+	pthread_join(ping_thread, &elapsed);
+	pthread_join(pong_thread, NULL);
+
+	return (long)elapsed / (iterations - iterations / 4);
+}
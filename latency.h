@@ -0,0 +1,14 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+/* Measure the round trip time (in ns) of bouncing a cache line between the
+ * two given OS cores, averaged over 'iterations' round trips. */
+int measure_core_latency(int os_core_a, int os_core_b, int iterations);
+
+#endif /* !LATENCY_H_ */
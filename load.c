@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "load.h"
+
+uint8_t core_load_pct[CPU_SETSIZE];
+
+/* The busy and total jiffies of every core at the previous sample. Only
+ * the sampling thread touches these. */
+static unsigned long long prev_busy[CPU_SETSIZE];
+static unsigned long long prev_total[CPU_SETSIZE];
+static bool prev_valid[CPU_SETSIZE];
+
+static char *load_path;
+static pthread_t load_thread;
+static int load_interval_ms;
+static volatile bool sampling;
+
+int load_sample(const char *path)
+{
+	char line[512];
+	int updated = 0;
+
+	FILE *f = fopen(path ? path : LOAD_STAT_PATH, "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		/* Only the per core lines: "cpuN user nice system idle iowait irq
+		 * softirq steal ...". */
+		int cpu, n;
+		if (strncmp(line, "cpu", 3) != 0 ||
+		    sscanf(line + 3, "%d%n", &cpu, &n) != 1 ||
+		    cpu < 0 || cpu >= CPU_SETSIZE)
+			continue;
+
+		unsigned long long v[8] = {0}, total = 0;
+		sscanf(line + 3 + n, "%llu %llu %llu %llu %llu %llu %llu %llu",
+		       &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+		for (int i = 0; i < 8; i++)
+			total += v[i];
+		unsigned long long busy = total - v[3] - v[4];
+
+		if (prev_valid[cpu] && total > prev_total[cpu]) {
+			int pct = (busy - prev_busy[cpu]) * 100 /
+			          (total - prev_total[cpu]);
+			set_core_load(cpu, pct);
+			updated++;
+		}
+		prev_busy[cpu] = busy;
+		prev_total[cpu] = total;
+		prev_valid[cpu] = true;
+	}
+	fclose(f);
+	return updated;
+}
+
+void set_core_load(int os_id, int percent)
+{
+	if (os_id < 0 || os_id >= CPU_SETSIZE)
+		return;
+	if (percent < 0)
+		percent = 0;
+	if (percent > 100)
+		percent = 100;
+	__atomic_store_n(&core_load_pct[os_id], percent, __ATOMIC_RELAXED);
+}
+
+static void *load_loop(void *arg)
+{
+	while (sampling) {
+		load_sample(load_path);
+		usleep(load_interval_ms * 1000);
+	}
+	return NULL;
+}
+
+int load_start(const char *path, int interval_ms)
+{
+	if (sampling || load_sample(path) < 0)
+		return -1;
+	free(load_path);
+	load_path = path ? strdup(path) : NULL;
+	load_interval_ms = interval_ms > 0 ? interval_ms : 1;
+	sampling = true;
+	if (pthread_create(&load_thread, NULL, load_loop, NULL) != 0) {
+		sampling = false;
+		return -1;
+	}
+	return 0;
+}
+
+void load_stop()
+{
+	if (!sampling)
+		return;
+	sampling = false;
+	pthread_join(load_thread, NULL);
+}
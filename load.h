@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef LOAD_H_
+#define LOAD_H_
+
+#include <stdint.h>
+#include <sched.h>
+
+#define LOAD_STAT_PATH "/proc/stat"
+
+/* The busy percentage of every OS core over the last sampling interval.
+ * Written only by the sampler and read without locks by the allocator. */
+extern uint8_t core_load_pct[CPU_SETSIZE];
+
+static inline int core_load(int os_id)
+{
+	if (os_id < 0 || os_id >= CPU_SETSIZE)
+		return 0;
+	return __atomic_load_n(&core_load_pct[os_id], __ATOMIC_RELAXED);
+}
+
+/* Take one sample of 'path' (a file in /proc/stat format, LOAD_STAT_PATH if
+ * NULL), updating the load of every core seen since the previous sample.
+ * Returns the number of cores updated, or -1 if path cannot be read. */
+int load_sample(const char *path);
+
+/* Sample 'path' every 'interval_ms' from a background thread. Returns 0 on
+ * success. */
+int load_start(const char *path, int interval_ms);
+void load_stop();
+
+/* Override the load of a core, for tests and simulations. */
+void set_core_load(int os_id, int percent);
+
+#endif /* !LOAD_H_ */
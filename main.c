@@ -33,44 +33,196 @@
 #include <sys/sysinfo.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "arch.h"
 #include "acpi.h"
 #include "topology.h"
 #include "schedule.h"
+#include "bandwidth.h"
+#include "stats.h"
+#include "trace.h"
+#include "load.h"
+#include "pmu.h"
+#include "freq.h"
+#include "cohort.h"
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cohort_lock *lock;
 static void *core_proxy(void *arg)
 {
 	int core = (int)(long)arg;
 	pin_to_core(core);
 
-	pthread_mutex_lock(&mutex);
+	cohort_lock(lock);
 	/* printf("numa_domain: %3d, socketid: %3d, chipid: %3d, coreid: %3d\n", */
 	/*        numa_domain(), socket_id(), chip_id(), core_id()); */
-	pthread_mutex_unlock(&mutex);
+	cohort_unlock(lock);
 }
 
 void test_id_funcs()
 {
-	int ncpus = get_nprocs();
+	int ncpus = cpu_topology_info.num_cores;
 	pthread_t pthread[ncpus];
 
+	lock = cohort_lock_create(COHORT_SOCKET, 0);
 	for (int i=0; i<ncpus; i++) {
-		pthread_create(&pthread[i], NULL, core_proxy, (void*)(long)i);
+		int os_id = cpu_topology_info.core_list[i].os_id;
+		pthread_create(&pthread[i], NULL, core_proxy, (void*)(long)os_id);
 	}
 	for (int i=0; i<ncpus; i++) {
 		pthread_join(pthread[i], NULL);
 	}
+	cohort_lock_destroy(lock);
+}
+
+/* How often the trace rings are drained to the trace file. */
+#define TRACE_DRAIN_INTERVAL_MS 100
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c cache_file] [-s stride] [-b megabytes]\n"
+	        "          [-d text|json] [-t trace_file] [-p pci_root]\n"
+	        "          [-l interval_ms] [-w load_weight] [-m interval_ms]\n"
+	        "          [-x llc_misses] [-I cpulist] [-T turbo_weight]\n"
+	        "          [-G sku_header]\n"
+	        "  -c  calibrate core distances from measured latencies, reusing\n"
+	        "      cache_file if it matches this machine and saving to it\n"
+	        "      otherwise\n"
+	        "  -s  only measure every stride'th core pair when calibrating\n"
+	        "  -b  probe per NUMA node memory bandwidth with a STREAM triad\n"
+	        "      over the given number of megabytes\n"
+	        "  -d  dump scheduler statistics when done\n"
+	        "  -t  record a binary trace of all scheduling decisions\n"
+	        "  -p  read PCI devices from pci_root instead of "
+	        PCI_SYSFS_ROOT "\n"
+	        "  -l  sample per core load from " LOAD_STAT_PATH " every\n"
+	        "      interval_ms\n"
+	        "  -w  how much a busy core weighs against distance when\n"
+	        "      allocating, in hundredths of a distance unit\n"
+	        "  -m  sample LLC misses and memory stalls per core every\n"
+	        "      interval_ms and report contended nodes when done\n"
+	        "  -x  keep new procs off sockets missing in their LLC more\n"
+	        "      than llc_misses times per ms per core\n"
+	        "  -I  reserve these OS cores for latency critical procs\n"
+	        "      instead of the isolcpus and nohz_full ones\n"
+	        "  -T  how much each percent of turbo clock lost on a socket\n"
+	        "      weighs against distance, in hundredths of a distance unit\n"
+	        "  -G  write the shape of this machine to sku_header and exit;\n"
+	        "      build with SKU=sku_header to specialize for it\n",
+	        prog);
+	exit(-1);
 }
 
 int main(int argc, char **argv)
 {
+	char *calibration_file = NULL;
+	int calibration_stride = 1;
+	int bandwidth_mb = 0;
+	char *stats_format = NULL;
+	char *trace_file = NULL;
+	char *pci_root = NULL;
+	int load_interval_ms = 0;
+	int pmu_interval_ms = 0;
+	char *isolated = NULL;
+	char *sku_header = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:s:b:d:t:p:l:w:m:x:I:T:G:")) != -1) {
+		switch (opt) {
+		case 'c':
+			calibration_file = optarg;
+			break;
+		case 's':
+			calibration_stride = atoi(optarg);
+			break;
+		case 'b':
+			bandwidth_mb = atoi(optarg);
+			break;
+		case 'd':
+			stats_format = optarg;
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		case 'p':
+			pci_root = optarg;
+			break;
+		case 'l':
+			load_interval_ms = atoi(optarg);
+			break;
+		case 'w':
+			set_load_weight(atoi(optarg));
+			break;
+		case 'm':
+			pmu_interval_ms = atoi(optarg);
+			break;
+		case 'x':
+			set_llc_miss_limit(strtoull(optarg, NULL, 0));
+			break;
+		case 'I':
+			isolated = optarg;
+			break;
+		case 'T':
+			set_turbo_weight(atoi(optarg));
+			break;
+		case 'G':
+			sku_header = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
 	acpiinit();	
 	topology_init();
+	if (sku_header) {
+		if (write_sku_header(sku_header) != 0) {
+			perror(sku_header);
+			return -1;
+		}
+		return 0;
+	}
+	freq_init(NULL);
 	nodes_init();
+	cpu_set_t isolated_cpus;
+	if (isolated == NULL)
+		get_isolated_cpus(&isolated_cpus);
+	else if (parse_cpulist(isolated, &isolated_cpus) != 0)
+		usage(argv[0]);
+	sched_set_isolated(&isolated_cpus);
+	if (sched_attach_devices(pci_root) < 0 && pci_root)
+		perror(pci_root);
+	if (calibration_file) {
+		if (load_core_distances(calibration_file) != 0) {
+			calibrate_core_distances(calibration_stride);
+			if (save_core_distances(calibration_file) != 0)
+				perror(calibration_file);
+		}
+	}
+	if (load_interval_ms && load_start(NULL, load_interval_ms) != 0)
+		perror(LOAD_STAT_PATH);
+	if (pmu_interval_ms) {
+		if (pmu_start(&cpu_topology_info.allowed_cpus, pmu_interval_ms) == 0)
+			fprintf(stderr, "hardware counters unavailable, "
+			        "not tracking contention\n");
+	}
+	if (bandwidth_mb)
+		probe_numa_bandwidth((size_t)bandwidth_mb << 20);
 	//print_cpu_topology();
+	//print_machine_topology();
 	test_id_funcs();
+	if (trace_file && trace_start(trace_file, TRACE_DRAIN_INTERVAL_MS) != 0)
+		perror(trace_file);
 	test_structure();
+	trace_stop();
+	load_stop();
+	if (pmu_interval_ms) {
+		print_node_pmu();
+		pmu_stop();
+	}
+	if (stats_format)
+		sched_stats_dump(stdout, strcmp(stats_format, "json") == 0);
 	return 0;
 }
 
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include "arch.h"
+#include "pci.h"
+
+static struct pci_device *pci_device_list;
+static int pci_device_count;
+
+/* Read a single integer (in any base strtol understands) from a sysfs
+ * attribute. Returns 0 on success. */
+static int read_sysfs_int(const char *path, long *val)
+{
+	char buf[64];
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	char *line = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (line == NULL)
+		return -1;
+	*val = strtol(line, NULL, 0);
+	return 0;
+}
+
+static int compare_devices(const void *a, const void *b)
+{
+	return strcmp(((const struct pci_device *)a)->name,
+	              ((const struct pci_device *)b)->name);
+}
+
+int pci_devices_init(const char *root)
+{
+	char path[4096];
+	struct dirent *de;
+	int size = 0;
+
+	if (root == NULL)
+		root = PCI_SYSFS_ROOT;
+	DIR *dir = opendir(root);
+	if (dir == NULL)
+		return -1;
+
+	free(pci_device_list);
+	pci_device_list = NULL;
+	pci_device_count = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' ||
+		    strlen(de->d_name) >= sizeof(pci_device_list->name))
+			continue;
+		if (pci_device_count == size) {
+			size = size ? size * 2 : 64;
+			struct pci_device *list = realloc(pci_device_list,
+			                                  size * sizeof(*list));
+			if (list == NULL) {
+				closedir(dir);
+				free(pci_device_list);
+				pci_device_list = NULL;
+				pci_device_count = 0;
+				return -1;
+			}
+			pci_device_list = list;
+		}
+		struct pci_device *d = &pci_device_list[pci_device_count++];
+		long val;
+
+		strcpy(d->name, de->d_name);
+		snprintf(path, sizeof(path), "%s/%s/class", root, de->d_name);
+		d->class = read_sysfs_int(path, &val) == 0 ? val : 0;
+		snprintf(path, sizeof(path), "%s/%s/numa_node", root, de->d_name);
+		d->numa_node = read_sysfs_int(path, &val) == 0 ? val : -1;
+		snprintf(path, sizeof(path), "%s/%s/local_cpulist", root,
+		         de->d_name);
+		if (read_cpulist(path, &d->local_cpus) != 0)
+			CPU_ZERO(&d->local_cpus);
+	}
+	closedir(dir);
+	qsort(pci_device_list, pci_device_count, sizeof(struct pci_device),
+	      compare_devices);
+	return pci_device_count;
+}
+
+int num_pci_devices()
+{
+	return pci_device_count;
+}
+
+struct pci_device *get_pci_device(int index)
+{
+	if (index < 0 || index >= pci_device_count)
+		return NULL;
+	return &pci_device_list[index];
+}
+
+/* Look a device up by its full name, or by its name without the leading
+ * "0000:" PCI domain. */
+struct pci_device *find_pci_device(const char *name)
+{
+	for (int i = 0; i < pci_device_count; i++) {
+		char *n = pci_device_list[i].name;
+		if (strcmp(n, name) == 0 ||
+		    (strncmp(n, "0000:", 5) == 0 && strcmp(n + 5, name) == 0))
+			return &pci_device_list[i];
+	}
+	return NULL;
+}
+
+void print_pci_devices()
+{
+	for (int i = 0; i < pci_device_count; i++) {
+		struct pci_device *d = &pci_device_list[i];
+		printf("%s class: 0x%06x, numa_node: %2d, local cpus: %d\n",
+		       d->name, d->class, d->numa_node, CPU_COUNT(&d->local_cpus));
+	}
+}
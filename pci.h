@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef PCI_H_
+#define PCI_H_
+
+#include <sched.h>
+
+#define PCI_SYSFS_ROOT "/sys/bus/pci/devices"
+
+struct pci_device {
+	char name[16];          /* domain:bus:device.function */
+	unsigned int class;
+	int numa_node;          /* -1 if the firmware does not tell */
+	cpu_set_t local_cpus;
+};
+
+/* Read every PCI device below root (PCI_SYSFS_ROOT if NULL). Returns the
+ * number of devices found, or -1 if root cannot be read or we run out of
+ * memory. */
+int pci_devices_init(const char *root);
+int num_pci_devices();
+struct pci_device *get_pci_device(int index);
+struct pci_device *find_pci_device(const char *name);
+void print_pci_devices();
+
+#endif /* !PCI_H_ */
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "pmu.h"
+
+uint64_t core_pmu_rate[NUM_PMU_COUNTERS][CPU_SETSIZE];
+
+/* The perf events we count for each of our counters. Memory stalls are
+ * approximated by backend stall cycles, which many cpus do not expose;
+ * that counter then simply stays 0. */
+static const uint64_t pmu_config[NUM_PMU_COUNTERS] = {
+	[PMU_LLC_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+	[PMU_MEM_STALLS] = PERF_COUNT_HW_STALLED_CYCLES_BACKEND,
+};
+
+/* Only the sampling thread touches these. */
+static int pmu_fd[NUM_PMU_COUNTERS][CPU_SETSIZE];
+static uint64_t pmu_prev[NUM_PMU_COUNTERS][CPU_SETSIZE];
+static uint64_t prev_ns;
+static int num_open;
+
+static pthread_t pmu_thread;
+static int pmu_interval_ms;
+static volatile bool sampling;
+
+static int perf_event_open(uint64_t config, int os_id)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	/* Count for every task running on the core, not just us. */
+	return syscall(__NR_perf_event_open, &attr, -1, os_id, -1, 0);
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pmu_sample()
+{
+	uint64_t ns = now_ns();
+	uint64_t ms = (ns - prev_ns) / 1000000;
+	prev_ns = ns;
+	for (int c = 0; c < NUM_PMU_COUNTERS; c++) {
+		for (int i = 0; i < CPU_SETSIZE; i++) {
+			uint64_t val;
+			if (pmu_fd[c][i] < 0 ||
+			    read(pmu_fd[c][i], &val, sizeof(val)) != sizeof(val))
+				continue;
+			if (ms)
+				set_core_pmu(c, i, (val - pmu_prev[c][i]) / ms);
+			pmu_prev[c][i] = val;
+		}
+	}
+}
+
+static void *pmu_loop(void *arg)
+{
+	while (sampling) {
+		usleep(pmu_interval_ms * 1000);
+		pmu_sample();
+	}
+	return NULL;
+}
+
+int pmu_start(const cpu_set_t *cpus, int interval_ms)
+{
+	if (sampling)
+		return num_open;
+
+	num_open = 0;
+	for (int c = 0; c < NUM_PMU_COUNTERS; c++) {
+		for (int i = 0; i < CPU_SETSIZE; i++) {
+			pmu_fd[c][i] = -1;
+			pmu_prev[c][i] = 0;
+			if (!CPU_ISSET(i, cpus))
+				continue;
+			pmu_fd[c][i] = perf_event_open(pmu_config[c], i);
+			if (pmu_fd[c][i] >= 0)
+				num_open++;
+		}
+	}
+	if (num_open == 0)
+		return 0;
+
+	prev_ns = now_ns();
+	pmu_interval_ms = interval_ms > 0 ? interval_ms : 1;
+	sampling = true;
+	if (pthread_create(&pmu_thread, NULL, pmu_loop, NULL) != 0) {
+		sampling = false;
+		pmu_stop();
+		return 0;
+	}
+	return num_open;
+}
+
+void pmu_stop()
+{
+	if (sampling) {
+		sampling = false;
+		pthread_join(pmu_thread, NULL);
+	}
+	if (num_open == 0)
+		return;
+	for (int c = 0; c < NUM_PMU_COUNTERS; c++) {
+		for (int i = 0; i < CPU_SETSIZE; i++) {
+			if (pmu_fd[c][i] >= 0)
+				close(pmu_fd[c][i]);
+			pmu_fd[c][i] = -1;
+		}
+	}
+	num_open = 0;
+}
+
+bool pmu_available()
+{
+	return num_open > 0;
+}
+
+void set_core_pmu(int counter, int os_id, uint64_t per_ms)
+{
+	if (counter < 0 || counter >= NUM_PMU_COUNTERS || os_id < 0 ||
+	    os_id >= CPU_SETSIZE)
+		return;
+	__atomic_store_n(&core_pmu_rate[counter][os_id], per_ms,
+	                 __ATOMIC_RELAXED);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef PMU_H_
+#define PMU_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sched.h>
+
+enum pmu_counter { PMU_LLC_MISSES, PMU_MEM_STALLS, NUM_PMU_COUNTERS };
+
+/* Per OS core event rates (events per millisecond) over the last sampling
+ * interval. Written only by the sampler and read without locks. They stay
+ * 0 wherever hardware counters cannot be opened. */
+extern uint64_t core_pmu_rate[NUM_PMU_COUNTERS][CPU_SETSIZE];
+
+static inline uint64_t core_pmu(int counter, int os_id)
+{
+	if (os_id < 0 || os_id >= CPU_SETSIZE)
+		return 0;
+	return __atomic_load_n(&core_pmu_rate[counter][os_id], __ATOMIC_RELAXED);
+}
+
+/* Open the counters on every core of 'cpus' and sample them every
+ * 'interval_ms' from a background thread. Returns the number of counters
+ * opened; 0 means we run as a stub (no perf support or not enough
+ * privileges) and all rates stay 0. */
+int pmu_start(const cpu_set_t *cpus, int interval_ms);
+void pmu_stop();
+bool pmu_available();
+
+/* Override the rate of a counter on a core, for tests and simulations. */
+void set_core_pmu(int counter, int os_id, uint64_t per_ms);
+
+#endif /* !PMU_H_ */
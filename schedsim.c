@@ -0,0 +1,720 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* schedsim replays a stream of scheduling events against the allocator in
+ * schedule.c on a synthetic topology, and reports how well the resulting
+ * placements hold up over time. The stream is either a text file, a binary
+ * trace recorded with cputopology -t, or generated on the fly.
+ *
+ * Text streams hold one event per line:
+ *   alloc <pid> <ncores>
+ *   free <pid> [<ncores>]
+ *   provision <pid> <core>
+ *   deprovision <pid> <core>
+ *   exit <pid>
+ *   device <pid> <pci device>
+ *   irqs <pid> <match> [nosmt]
+ *   load <core> <percent busy>
+ *   llc <core> <misses per ms>
+ *   class <pid> general|isolated
+ *   bandwidth <pid> <MB/s per core>
+ *
+ * Once the stream is replayed, every proc is destroyed and the allocator
+ * must have given back all the bandwidth it charged to NUMA nodes.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "topology.h"
+#include "schedule.h"
+#include "stats.h"
+#include "trace.h"
+#include "journal.h"
+#include "irq.h"
+#include "load.h"
+#include "pmu.h"
+#include "arch.h"
+#include "freq.h"
+
+struct sim_proc {
+	struct proc proc;
+	int ncores;
+	int home_numa;
+	/* Maps the cores a traced proc was given to the ones we gave it, so
+	 * traced frees release the matching simulated core. */
+	int *rec_core, *sim_core;
+	int nmapped, map_size;
+};
+
+/* Procs are kept in an open addressing table of pointers keyed by pid. The
+ * procs themselves never move, since their queue heads are referenced by
+ * the allocator. */
+static struct sim_proc **procs;
+static int procs_size;
+static int procs_used;
+
+/* Where IRQ plans are written, if anywhere. */
+static char *irq_root;
+
+static int total_cores;
+static int free_cores;
+
+/* Running totals for the current reporting interval. */
+static uint64_t interval_allocs;
+static uint64_t interval_spills;
+static uint64_t interval_alloc_ns;
+static uint64_t max_alloc_ns;
+static uint64_t failed_allocs;
+
+/* The number of cores a compaction pass may move at every report, or 0 to
+ * never compact. */
+static int compaction_moves;
+static uint64_t total_migrations;
+
+/* Where the allocator state is checkpointed at every report, if anywhere. */
+static char *checkpoint_file;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct sim_proc **proc_slot(struct sim_proc **table, int size, int pid)
+{
+	unsigned int h = (unsigned int)pid * 2654435761u;
+	for (int i = 0; ; i++) {
+		struct sim_proc **slot = &table[(h + i) & (size - 1)];
+		if (*slot == NULL || (*slot)->proc.pid == pid)
+			return slot;
+	}
+}
+
+static struct sim_proc *get_proc(int pid)
+{
+	if ((procs_used + 1) * 2 > procs_size) {
+		int new_size = procs_size ? procs_size * 2 : 1024;
+		struct sim_proc **table = calloc(new_size, sizeof(struct sim_proc*));
+		for (int i = 0; i < procs_size; i++)
+			if (procs[i])
+				*proc_slot(table, new_size, procs[i]->proc.pid) = procs[i];
+		free(procs);
+		procs = table;
+		procs_size = new_size;
+	}
+	struct sim_proc **slot = proc_slot(procs, procs_size, pid);
+	if (*slot == NULL) {
+		struct sim_proc *sp = calloc(1, sizeof(struct sim_proc));
+		sp->proc.pid = pid;
+		sp->home_numa = -1;
+		sched_proc_init(&sp->proc);
+		*slot = sp;
+		procs_used++;
+	}
+	return *slot;
+}
+
+/* Returns the number of cores allocated to a proc. */
+static int proc_cores(struct sim_proc *sp)
+{
+	int n = 0;
+	struct sched_pcore *c;
+	STAILQ_FOREACH(c, &sp->proc.ksched_data.alloc_me, alloc_next)
+		n++;
+	return n;
+}
+
+static void update_free_cores()
+{
+	int used_cores = 0;
+	for (int i = 0; i < sched_num_nodes(NUMA); i++) {
+		int used, total, stranded;
+		sched_node_usage(NUMA, i, &used, &total, &stranded);
+		used_cores += used;
+	}
+	free_cores = total_cores - used_cores;
+}
+
+static struct proc *lookup_proc(int pid, void *arg)
+{
+	return &get_proc(pid)->proc;
+}
+
+/* Pick up where a previous run left off, from its last checkpoint and the
+ * journal of what it did since. */
+static int restore(const char *journal_file)
+{
+	uint64_t start = now_ns();
+	int n = sched_restore(checkpoint_file, journal_file, lookup_proc, NULL);
+	if (n < 0)
+		return -1;
+	for (int i = 0; i < procs_size; i++) {
+		if (procs[i])
+			procs[i]->ncores = sched_proc_cores_in(&procs[i]->proc,
+			                                       MACHINE, 0);
+	}
+	update_free_cores();
+	fprintf(stderr, "restored %d procs and %d journal records in %.3f ms\n",
+	        procs_used, n, (now_ns() - start) / 1e6);
+	return 0;
+}
+
+static void map_core(struct sim_proc *sp, int rec_core, int sim_core)
+{
+	if (sp->nmapped == sp->map_size) {
+		sp->map_size = sp->map_size ? sp->map_size * 2 : 8;
+		sp->rec_core = realloc(sp->rec_core, sp->map_size * sizeof(int));
+		sp->sim_core = realloc(sp->sim_core, sp->map_size * sizeof(int));
+	}
+	sp->rec_core[sp->nmapped] = rec_core;
+	sp->sim_core[sp->nmapped] = sim_core;
+	sp->nmapped++;
+}
+
+/* Returns the simulated core matching a recorded one, and forgets about it,
+ * or -1 if the proc never got that core in the simulation. */
+static int unmap_core(struct sim_proc *sp, int rec_core)
+{
+	for (int i = 0; i < sp->nmapped; i++) {
+		if (sp->rec_core[i] == rec_core) {
+			int sim_core = sp->sim_core[i];
+			sp->nmapped--;
+			sp->rec_core[i] = sp->rec_core[sp->nmapped];
+			sp->sim_core[i] = sp->sim_core[sp->nmapped];
+			return sim_core;
+		}
+	}
+	return -1;
+}
+
+/* Allocate 'n' cores to a proc, one at a time so each placement decision is
+ * timed and checked on its own. If 'rec_core' is not -1, the new core is
+ * remembered as the simulated stand-in for that recorded core. */
+static void sim_alloc(struct sim_proc *sp, int n, int rec_core)
+{
+	for (int i = 0; i < n; i++) {
+		update_free_cores();
+		if (free_cores == 0) {
+			failed_allocs++;
+			return;
+		}
+		uint64_t start = now_ns();
+		alloc_core_any(&sp->proc, 1);
+		uint64_t ns = now_ns() - start;
+		/* The machine may have free cores in another class only. */
+		if (proc_cores(sp) == sp->ncores) {
+			failed_allocs++;
+			return;
+		}
+
+		struct sched_pcore *c, *last = NULL;
+		STAILQ_FOREACH(c, &sp->proc.ksched_data.alloc_me, alloc_next)
+			last = c;
+		int numa = last->spc_info->numa_id;
+		if (sp->home_numa == -1 || sp->ncores == 0)
+			sp->home_numa = numa;
+		else if (numa != sp->home_numa)
+			interval_spills++;
+		if (rec_core != -1)
+			map_core(sp, rec_core, last->spn->id);
+		sp->ncores = proc_cores(sp);
+		interval_allocs++;
+		interval_alloc_ns += ns;
+		if (ns > max_alloc_ns)
+			max_alloc_ns = ns;
+	}
+}
+
+/* Free 'n' of a proc's cores, oldest first. */
+static void sim_free(struct sim_proc *sp, int n)
+{
+	for (int i = 0; i < n; i++) {
+		struct sched_pcore *c = STAILQ_FIRST(&sp->proc.ksched_data.alloc_me);
+		if (c == NULL)
+			break;
+		free_core_specific(&sp->proc, c->spn->id);
+	}
+	sp->ncores = proc_cores(sp);
+}
+
+static void sim_exit(struct sim_proc *sp)
+{
+	struct sched_pcore *c;
+	sim_free(sp, sp->ncores);
+	while ((c = STAILQ_FIRST(&sp->proc.ksched_data.prov_not_alloc_me)))
+		deprovision_core_specific(&sp->proc, c->spn->id);
+	sp->nmapped = 0;
+}
+
+/* Keep our traced core mappings in sync with cores moved by compaction. */
+static void remap_core(struct proc *p, int from_core, int to_core)
+{
+	struct sim_proc *sp = (struct sim_proc*)p;
+	for (int i = 0; i < sp->nmapped; i++)
+		if (sp->sim_core[i] == from_core)
+			sp->sim_core[i] = to_core;
+}
+
+/* Print one line of metrics about the current state of the machine, and
+ * reset the per interval totals. */
+static void report(uint64_t events)
+{
+	int free_total = 0, stranded_total = 0;
+
+	if (compaction_moves) {
+		struct sched_migration moves[compaction_moves];
+		int n = compact_procs(compaction_moves, true, moves);
+		for (int i = 0; i < n; i++)
+			remap_core(moves[i].p, moves[i].from_core, moves[i].to_core);
+		total_migrations += n;
+	}
+	if (checkpoint_file && sched_checkpoint(checkpoint_file) != 0)
+		perror(checkpoint_file);
+	update_free_cores();
+	for (int i = 0; i < sched_num_nodes(SOCKET); i++) {
+		int used, total, stranded;
+		sched_node_usage(SOCKET, i, &used, &total, &stranded);
+		free_total += total - used;
+		stranded_total += stranded;
+	}
+
+	/* Average the mean pairwise core distance of every multi core proc,
+	 * and count how many more sockets procs span than they would need. */
+	double dist_sum = 0;
+	int dist_procs = 0, extra_sockets = 0, active_procs = 0;
+	int cores_per_socket = total_cores / sched_num_nodes(SOCKET);
+	for (int i = 0; i < procs_size; i++) {
+		struct sim_proc *sp = procs[i];
+		if (sp == NULL || sp->ncores == 0)
+			continue;
+		active_procs++;
+		int nspanned = sched_proc_nodes(&sp->proc, SOCKET);
+		long d = 0, pairs = 0;
+		struct sched_pcore *a, *b;
+		STAILQ_FOREACH(a, &sp->proc.ksched_data.alloc_me, alloc_next) {
+			for (b = STAILQ_NEXT(a, alloc_next); b;
+			     b = STAILQ_NEXT(b, alloc_next)) {
+				d += sched_core_distance(a->spn->id, b->spn->id);
+				pairs++;
+			}
+		}
+		if (pairs) {
+			dist_sum += (double)d / pairs;
+			dist_procs++;
+		}
+		int needed = (sp->ncores + cores_per_socket - 1) / cores_per_socket;
+		extra_sockets += nspanned - needed;
+	}
+
+	printf("%10llu %6.1f%% %8.1f%% %8.2f %8.3f %7.1f%% %9.0f %9llu %7llu "
+	       "%8llu\n",
+	       (unsigned long long)events,
+	       100.0 * (total_cores - free_cores) / total_cores,
+	       free_total ? 100.0 * stranded_total / free_total : 0.0,
+	       active_procs ? (double)extra_sockets / active_procs : 0.0,
+	       dist_procs ? dist_sum / dist_procs : 0.0,
+	       interval_allocs ? 100.0 * interval_spills / interval_allocs : 0.0,
+	       interval_allocs ? (double)interval_alloc_ns / interval_allocs : 0.0,
+	       (unsigned long long)max_alloc_ns,
+	       (unsigned long long)failed_allocs,
+	       (unsigned long long)total_migrations);
+	interval_allocs = 0;
+	interval_spills = 0;
+	interval_alloc_ns = 0;
+	max_alloc_ns = 0;
+}
+
+static void print_report_header()
+{
+	printf("%10s %7s %9s %8s %8s %8s %9s %9s %7s %8s\n",
+	       "events", "used", "stranded", "x-socket", "distance", "spill",
+	       "alloc_ns", "max_ns", "failed", "migrated");
+}
+
+static int replay_text(FILE *f, int interval)
+{
+	char line[256], op[32], device[32], flag[32];
+	int pid, arg;
+	uint64_t events = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		int n = sscanf(line, "%31s %d %d", op, &pid, &arg);
+		if (n < 2 || op[0] == '#')
+			continue;
+		/* Loads and LLC misses are per core: the pid field holds a core
+		 * for them. */
+		bool per_core = strcmp(op, "load") == 0 || strcmp(op, "llc") == 0;
+		struct sim_proc *sp = per_core ? NULL : get_proc(pid);
+		if (strcmp(op, "device") == 0) {
+			if (sscanf(line, "%*s %*d %31s", device) != 1 ||
+			    set_proc_device(&sp->proc, device) != 0) {
+				fprintf(stderr, "bad device: %s", line);
+				return -1;
+			}
+		} else if (strcmp(op, "irqs") == 0) {
+			int nf = sscanf(line, "%*s %*d %31s %31s", device, flag);
+			if (nf < 1 || plan_irqs(&sp->proc, irq_root, device,
+			                        nf == 2 && strcmp(flag, "nosmt") == 0,
+			                        irq_root != NULL) < 0) {
+				fprintf(stderr, "bad irqs: %s", line);
+				return -1;
+			}
+		} else if (strcmp(op, "load") == 0 && n == 3) {
+			set_core_load(cpu_topology_info.core_list[pid % total_cores].os_id,
+			              arg);
+		} else if (strcmp(op, "class") == 0) {
+			if (sscanf(line, "%*s %*d %31s", flag) != 1) {
+				fprintf(stderr, "bad class: %s", line);
+				return -1;
+			}
+			set_proc_class(&sp->proc, strcmp(flag, "isolated") == 0 ?
+			                          CLASS_ISOLATED : CLASS_GENERAL);
+		} else if (strcmp(op, "bandwidth") == 0 && n == 3) {
+			set_proc_bandwidth(&sp->proc, arg);
+		} else if (strcmp(op, "llc") == 0 && n == 3) {
+			set_core_pmu(PMU_LLC_MISSES,
+			             cpu_topology_info.core_list[pid % total_cores].os_id,
+			             arg);
+		} else if (strcmp(op, "alloc") == 0 && n == 3) {
+			sim_alloc(sp, arg, -1);
+		} else if (strcmp(op, "free") == 0) {
+			sim_free(sp, n == 3 ? arg : 1);
+		} else if (strcmp(op, "provision") == 0 && n == 3) {
+			provision_core(&sp->proc, arg % total_cores);
+		} else if (strcmp(op, "deprovision") == 0 && n == 3) {
+			deprovision_core_specific(&sp->proc, arg % total_cores);
+		} else if (strcmp(op, "exit") == 0) {
+			sim_exit(sp);
+		} else {
+			fprintf(stderr, "bad event: %s", line);
+			return -1;
+		}
+		if (++events % interval == 0)
+			report(events);
+	}
+	if (events % interval)
+		report(events);
+	return 0;
+}
+
+static int compare_tsc(const void *a, const void *b)
+{
+	const struct trace_record *ra = a, *rb = b;
+	return ra->tsc < rb->tsc ? -1 : ra->tsc > rb->tsc;
+}
+
+/* Replay a binary trace. Records were drained per thread, so they are
+ * sorted by time first. Recorded core numbers are only used to match frees
+ * and provisions to the cores the simulated allocator picked. */
+static int replay_trace(FILE *f, int interval)
+{
+	struct trace_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+	    memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 ||
+	    h.version != TRACE_VERSION ||
+	    h.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "not a trace file\n");
+		return -1;
+	}
+
+	size_t n = 0, size = 1 << 16;
+	struct trace_record *recs = malloc(size * sizeof(struct trace_record));
+	while (fread(&recs[n], sizeof(struct trace_record), 1, f) == 1) {
+		if (++n == size) {
+			size *= 2;
+			recs = realloc(recs, size * sizeof(struct trace_record));
+		}
+	}
+	qsort(recs, n, sizeof(struct trace_record), compare_tsc);
+
+	for (size_t i = 0; i < n; i++) {
+		struct trace_record *r = &recs[i];
+		struct sim_proc *sp = get_proc(r->pid);
+		int core;
+		switch (r->event) {
+		case TRACE_ALLOC:
+			sim_alloc(sp, 1, r->core);
+			break;
+		case TRACE_FREE:
+			core = unmap_core(sp, r->core);
+			if (core == -1)
+				sim_free(sp, 1);
+			else
+				free_core_specific(&sp->proc, core);
+			sp->ncores = proc_cores(sp);
+			break;
+		case TRACE_PROVISION:
+			provision_core(&sp->proc, r->core % total_cores);
+			break;
+		case TRACE_DEPROVISION:
+			deprovision_core_specific(&sp->proc, r->core % total_cores);
+			break;
+		}
+		if ((i + 1) % interval == 0)
+			report(i + 1);
+	}
+	if (n % interval)
+		report(n);
+	free(recs);
+	return 0;
+}
+
+/* Generate random churn: procs come and go, and grow and shrink while they
+ * live. Requests that do not fit on the machine are dropped. */
+static void replay_synthetic(uint64_t nevents, int nprocs, int max_req,
+                             int interval)
+{
+	for (uint64_t i = 0; i < nevents; i++) {
+		struct sim_proc *sp = get_proc(1 + random() % nprocs);
+		int r = random() % 100;
+		if (sp->ncores == 0)
+			sim_alloc(sp, 1 + random() % max_req, -1);
+		else if (r < 45)
+			sim_alloc(sp, 1 + random() % (max_req / 4 + 1), -1);
+		else if (r < 90)
+			sim_free(sp, 1 + random() % sp->ncores);
+		else
+			sim_exit(sp);
+		if ((i + 1) % interval == 0)
+			report(i + 1);
+	}
+	if (nevents % interval)
+		report(nevents);
+}
+
+/* Destroy every proc and check that no NUMA node is left with bandwidth
+ * charged to it. The journal is closed first, so that these exits do not
+ * undo the replayed state for a later restore. Returns 0 on success. */
+static int check_released()
+{
+	int ret = 0;
+	journal_stop();
+	for (int i = 0; i < procs_size; i++) {
+		if (procs[i])
+			sched_proc_destroy(&procs[i]->proc);
+	}
+	for (int n = 0; n < cpu_topology_info.num_numa; n++) {
+		int used = sched_bandwidth_used(n);
+		if (used != 0) {
+			fprintf(stderr, "NUMA %d has %d MB/s charged after every "
+			        "proc exited\n", n, used);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s [-T numa x sockets x cpus x cores | -F topology]\n"
+	        "          [-D pci_root] [-R proc_root] [-i interval]\n"
+	        "          [-d text|json] [-C max_moves] [-w load_weight]\n"
+	        "          [-x llc_misses] [-I cores] [-Q cpufreq_root]\n"
+	        "          [-U turbo_weight] [-K checkpoint] [-J journal]\n"
+	        "          (-f events | -g nevents [-p nprocs]\n"
+	        "          [-r max_request] [-S seed])\n"
+	        "  -T  shape of the simulated machine, e.g. 2x1x8x2\n"
+	        "  -F  read an irregular machine from a file with one\n"
+	        "      'numa socket cpu' line per core\n"
+	        "  -D  attach the PCI devices found below pci_root\n"
+	        "  -R  read IRQs from proc_root/interrupts and write planned\n"
+	        "      masks below it, instead of printing them\n"
+	        "  -f  replay a text event file or a binary trace ('-' for "
+	        "stdin)\n"
+	        "  -g  replay this many randomly generated events\n"
+	        "  -i  report metrics every interval events\n"
+	        "  -d  dump scheduler statistics when done\n"
+	        "  -w  how much a busy core weighs against distance when\n"
+	        "      allocating, in hundredths of a distance unit\n"
+	        "  -x  keep new procs off sockets missing in their LLC more\n"
+	        "      than llc_misses times per ms per core\n"
+	        "  -I  reserve this list of cores (e.g. 0-3,8) for procs of\n"
+	        "      the isolated class\n"
+	        "  -Q  read core clocks from a cpufreq tree below cpufreq_root\n"
+	        "  -U  how much each percent of turbo clock lost on a socket\n"
+	        "      weighs against distance, in hundredths of a distance unit\n"
+	        "  -C  run a compaction pass moving at most max_moves cores at\n"
+	        "      every report\n"
+	        "  -K  restore the allocator from checkpoint if it exists, and\n"
+	        "      checkpoint it at every report\n"
+	        "  -J  journal every allocator change, and replay the journal\n"
+	        "      on top of the checkpoint when restoring\n", prog);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	int numa = 2, sockets = 1, cpus = 8, cores = 2;
+	int interval = 10000, nprocs = 8, max_req = 8, opt;
+	uint64_t nevents = 0;
+	char *events_file = NULL, *stats_format = NULL, *topo_file = NULL;
+	char *pci_root = NULL;
+	char *isolated = NULL;
+	char *journal_file = NULL;
+
+	while ((opt = getopt(argc, argv, "T:F:D:R:f:g:p:r:S:i:d:C:w:x:I:Q:U:K:J:")) != -1) {
+		switch (opt) {
+		case 'T':
+			if (sscanf(optarg, "%dx%dx%dx%d", &numa, &sockets, &cpus,
+			           &cores) != 4)
+				usage(argv[0]);
+			break;
+		case 'F':
+			topo_file = optarg;
+			break;
+		case 'D':
+			pci_root = optarg;
+			break;
+		case 'R':
+			irq_root = optarg;
+			break;
+		case 'f':
+			events_file = optarg;
+			break;
+		case 'g':
+			nevents = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			nprocs = atoi(optarg);
+			break;
+		case 'r':
+			max_req = atoi(optarg);
+			break;
+		case 'S':
+			srandom(atoi(optarg));
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'd':
+			stats_format = optarg;
+			break;
+		case 'C':
+			compaction_moves = atoi(optarg);
+			break;
+		case 'w':
+			set_load_weight(atoi(optarg));
+			break;
+		case 'x':
+			set_llc_miss_limit(strtoull(optarg, NULL, 0));
+			break;
+		case 'I':
+			isolated = optarg;
+			break;
+		case 'Q':
+			if (freq_init(optarg) == 0) {
+				fprintf(stderr, "no cpufreq data below %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'U':
+			set_turbo_weight(atoi(optarg));
+			break;
+		case 'K':
+			checkpoint_file = optarg;
+			break;
+		case 'J':
+			journal_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((events_file == NULL) == (nevents == 0) || interval < 1 ||
+	    nprocs < 1 || max_req < 1 || numa < 1 || sockets < 1 || cpus < 1 ||
+	    cores < 1)
+		usage(argv[0]);
+
+	if (topo_file) {
+		if (topology_init_from_file(topo_file) < 0) {
+			perror(topo_file);
+			return -1;
+		}
+	} else {
+		topology_init_synthetic(numa, sockets, cpus, cores);
+	}
+	nodes_init();
+	if (isolated) {
+		cpu_set_t isolated_cpus;
+		if (parse_cpulist(isolated, &isolated_cpus) != 0)
+			usage(argv[0]);
+		sched_set_isolated(&isolated_cpus);
+	}
+	if (pci_root && sched_attach_devices(pci_root) < 0) {
+		perror(pci_root);
+		return -1;
+	}
+	total_cores = cpu_topology_info.num_cores;
+	free_cores = total_cores;
+	if (checkpoint_file && access(checkpoint_file, F_OK) == 0 &&
+	    restore(journal_file) != 0) {
+		perror(checkpoint_file);
+		return -1;
+	}
+	if (journal_file && journal_start(journal_file, false) != 0) {
+		perror(journal_file);
+		return -1;
+	}
+
+	print_report_header();
+	uint64_t start = now_ns();
+	int ret = 0;
+	if (events_file) {
+		FILE *f = strcmp(events_file, "-") ? fopen(events_file, "r") : stdin;
+		if (f == NULL) {
+			perror(events_file);
+			return -1;
+		}
+		int c = getc(f);
+		ungetc(c, f);
+		if (c == TRACE_MAGIC[0])
+			ret = replay_trace(f, interval);
+		else
+			ret = replay_text(f, interval);
+		fclose(f);
+	} else {
+		replay_synthetic(nevents, nprocs, max_req, interval);
+	}
+	fprintf(stderr, "replayed in %.3f s\n", (now_ns() - start) / 1e9);
+
+	if (stats_format)
+		sched_stats_dump(stdout, strcmp(stats_format, "json") == 0);
+	if (check_released() != 0)
+		ret = -1;
+	return ret;
+}
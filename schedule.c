@@ -30,13 +30,29 @@
  * SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/queue.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <numa.h>
 #include "schedule.h"
 #include "topology.h"
+#include "latency.h"
+#include "stats.h"
+#include "trace.h"
+#include "load.h"
+#include "pmu.h"
+#include "freq.h"
+#include "journal.h"
 
 #define num_cores           (cpu_topology_info.num_cores)
 #define num_cores_power2    (cpu_topology_info.num_cores_power2)
@@ -50,8 +66,41 @@
 #define cpus_per_numa       (cpu_topology_info.cpus_per_numa)
 #define sockets_per_numa    (cpu_topology_info.sockets_per_numa)
 
+/* The number of cache line round trips timed per core pair during
+ * calibration. */
+#define CALIBRATION_ITERATIONS 10000
+
 #define child_node_type(t) ((t) - 1)
-#define num_children(t) ((t) ? num_descendants[(t)][(t)-1] : 0)
+
+/* A header written by write_sku_header() describes the shape of a machine
+ * as constants. Building against it lets the lookups below turn into
+ * divisions by constants, as long as the machine we run on has exactly
+ * that shape; sku_match is cleared otherwise and we use the values found
+ * at runtime. Without a header, the specialized paths are dead code. */
+#ifdef CONFIG_SCHED_SKU
+#include CONFIG_SCHED_SKU
+static bool sku_match;
+#else
+#define sku_match            false
+#define SKU_CORES_PER_CPU    1
+#define SKU_CORES_PER_SOCKET 1
+#define SKU_CORES_PER_NUMA   1
+#define SKU_NUM_CORES        1
+#endif
+
+/* The number of cores below a node of the given level of the SKU. */
+#define sku_cores_below(level) \
+	((level) == CORE    ? 1 : \
+	 (level) == CPU     ? SKU_CORES_PER_CPU : \
+	 (level) == SOCKET  ? SKU_CORES_PER_SOCKET : \
+	 (level) == NUMA    ? SKU_CORES_PER_NUMA : SKU_NUM_CORES)
+
+#define get_node_id(core_info, level) \
+	(sku_match ? (unsigned int)(core_info)->core_id / sku_cores_below(level) : \
+	 (level) == CORE    ? (core_info)->core_id : \
+	 (level) == CPU     ? (core_info)->cpu_id : \
+	 (level) == SOCKET  ? (core_info)->socket_id : \
+	 (level) == NUMA    ? (core_info)->numa_id : 0)
 
 /* An array containing the number of nodes at each level. */
 static int num_nodes[NUM_NODE_TYPES];
@@ -59,8 +108,45 @@ static int num_nodes[NUM_NODE_TYPES];
 /* A 2D array containing for all core i its distance from a core j. */
 static int **core_distance;
 
-/* An array containing the number of children at each level. */
-static int num_descendants[NUM_NODE_TYPES][NUM_NODE_TYPES];
+/* The other cores sorted by their distance from a core, nearest first, with
+ * ties broken by core id. Cores at the same distance form a run, which ends
+ * just before index 'end' of the order. */
+struct neighbor_run {
+	int distance;
+	int end;
+};
+
+struct core_neighbors {
+	uint16_t *order;
+	struct neighbor_run *runs;
+	int nr_runs;
+};
+static struct core_neighbors *neighbors;
+
+/* The local memory bandwidth (in MB/s) of each NUMA node, the bandwidth
+ * currently claimed on it by the procs with cores there, and the percentage
+ * of a node's bandwidth we are willing to hand out. A bandwidth of 0 means
+ * the node has not been probed and is never considered saturated. */
+static int *numa_bandwidth;
+static int *numa_bandwidth_used;
+static int bandwidth_limit = 80;
+
+/* How much a fully busy core adds to its distance score, in hundredths of
+ * a distance unit. With 0, load only breaks ties between equally distant
+ * cores. */
+static int load_weight = 0;
+
+/* How much each percent of clock a socket is expected to lose by getting
+ * one more busy core weighs against distance, in hundredths of a distance
+ * unit. With 0, placement ignores turbo headroom. */
+static int turbo_weight = 0;
+
+/* The LLC miss rate (misses per ms per core) above which a socket counts
+ * as contended, and new procs avoid it. 0 disables the check. */
+static uint64_t llc_miss_limit = 0;
+
+/* The OS cores of the whole machine, which has no node of its own. */
+static cpu_set_t machine_cpus;
 
 /* A list of lookup tables to find specific nodes by type and id. */
 static int total_nodes;
@@ -68,107 +154,940 @@ static struct sched_pnode *node_list;
 static struct sched_pcore *core_list;
 static struct sched_pnode *node_lookup[NUM_NODE_TYPES];
 
+/* The cores of each class, and how many of them are allocated. Isolated
+ * cores are also kept in a flat list, so their search can skip the tree. */
+static int class_total[NUM_CORE_CLASSES];
+static int class_used[NUM_CORE_CLASSES];
+static int *isolated_list;
+static int num_isolated;
+
+/* Procs get a dense slot number, their bit in the proc_map of nodes. The
+ * maps of all nodes grow together when we run out of slots. */
+static int core_map_words;
+static int proc_map_words;
+static struct proc **slot_procs;
+static int *free_slots;
+static int num_free_slots;
+static int num_slots;
+
+/* Protects all allocation state below, and the scheduler fields of every
+ * proc. Taken by all of our exported entry points. */
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* All procs initialized with sched_proc_init(), for the compaction pass. */
+static LIST_HEAD(, proc) all_procs = LIST_HEAD_INITIALIZER(all_procs);
+
+/* Procs waiting for cores, by decreasing priority. */
+static TAILQ_HEAD(sched_waiter_list, sched_waiter) waiters =
+	TAILQ_HEAD_INITIALIZER(waiters);
+
+/* State of the background compaction thread. */
+static pthread_t compaction_thread;
+static volatile bool compacting;
+static int compaction_interval_ms;
+static int compaction_max_migrations;
+static void (*compaction_cb)(int pid, int from_core, int to_core);
+
+/* What a search for a core found: the distance of the chosen core to the
+ * cores its proc already owns, and the number of candidates scored. */
+struct sched_search {
+	int distance;
+	int candidates;
+	int level;      /* Level the search ended at, if it walked the tree */
+};
+
+static inline void map_set(uint64_t *map, int bit)
+{
+	map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline void map_clear(uint64_t *map, int bit)
+{
+	map[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+/* The bits of word w of a map that fall in [first, last). */
+static inline uint64_t range_mask(int w, int first, int last)
+{
+	int lo = first > w * 64 ? first - w * 64 : 0;
+	int hi = last < (w + 1) * 64 ? last - w * 64 : 64;
+	uint64_t mask = hi == 64 ? ~0ULL : (1ULL << hi) - 1;
+	return mask & ~((1ULL << lo) - 1);
+}
+
+/* Count the bits of a map set in [first, first + n). */
+static int map_count(const uint64_t *map, int first, int n)
+{
+	int count = 0;
+	for (int w = first / 64; w * 64 < first + n; w++)
+		count += __builtin_popcountll(map[w] & range_mask(w, first,
+		                                                  first + n));
+	return count;
+}
+
+/* Returns true if any bit of a map is set in [first, first + n). */
+static bool map_any(const uint64_t *map, int first, int n)
+{
+	for (int w = first / 64; w * 64 < first + n; w++) {
+		if (map[w] & range_mask(w, first, first + n))
+			return true;
+	}
+	return false;
+}
+
 /* Forward declare some functions. */
 static struct sched_pcore *alloc_core(struct proc *p, struct sched_pcore *c);
+static void grant_waiters();
 
-/* Create a node and initialize it. */
-static void init_nodes(int type, int num, int nchildren)
+/* Set up the lookup table for the nodes of a given type. */
+static void init_lookup(int type, int num)
 {
-	/* Initialize the lookup tables for this node type. */
 	num_nodes[type] = num;
 	node_lookup[type] = node_list;
 	for (int i = CORE; i < type; i++)
 		node_lookup[type] += num_nodes[i];
+}
 
-	/* Initialize all fields of each node. */
-	for (int i = 0; i < num; i++) {
+/* Initialize all fields of nodes first to last of a given type. */
+static void init_nodes(int type, int first, int last)
+{
+	for (int i = first; i <= last; i++) {
 		struct sched_pnode *n = &node_lookup[type][i];
 		n->id = i;
 		n->type = type;
 		memset(n->refcount, 0, sizeof(n->refcount));
 		n->parent = NULL;
-		n->children = &node_lookup[child_node_type(type)][i * nchildren];
-		for (int j = 0; j < nchildren; j++)
-			n->children[j].parent = n;
+		n->children = NULL;
+		n->nr_children = 0;
+		n->first_core = -1;
+		n->nr_cores = 0;
+		CPU_ZERO(&n->cpus);
+		n->proc_map = NULL;
 
 		n->spc_data = NULL;
+		STAILQ_INIT(&n->devices);
 		if (n->type == CORE) {
 			n->spc_data = &core_list[n->id];
 			n->spc_data->spn = n;
 			n->spc_data->spc_info = &cpu_topology_info.core_list[n->id];
 			n->spc_data->alloc_proc = NULL;
 			n->spc_data->prov_proc = NULL;
+			n->spc_data->core_class = CLASS_GENERAL;
+			n->spc_data->bw_charged = 0;
+		}
+	}
+}
+
+/* Link every node above cores first to last - 1 to its parent, and every
+ * parent to the contiguous range of its children, following the ids
+ * recorded in each core's core_info. Nodes are free to have different
+ * numbers of children. Every node also records the range of cores below
+ * it. The range must cover whole NUMA nodes. */
+static void link_nodes(int first, int last)
+{
+	for (int i = first; i < last; i++) {
+		struct core_info *ci = core_list[i].spc_info;
+		for (int k = CORE; k < MACHINE; k++) {
+			struct sched_pnode *n = &node_lookup[k][get_node_id(ci, k)];
+			if (n->first_core == -1)
+				n->first_core = i;
+			n->nr_cores++;
+		}
+	}
+	for (int k = CORE; k < NUMA; k++) {
+		int lo = get_node_id(core_list[first].spc_info, k);
+		int hi = get_node_id(core_list[last - 1].spc_info, k);
+		for (int i = lo; i <= hi; i++) {
+			struct sched_pnode *n = &node_lookup[k][i];
+			struct core_info *ci = core_list[n->first_core].spc_info;
+			struct sched_pnode *parent =
+				&node_lookup[k + 1][get_node_id(ci, k + 1)];
+			n->parent = parent;
+			if (parent->children == NULL)
+				parent->children = n;
+			parent->nr_children++;
 		}
 	}
 }
 
-/* Allocate a flat array of array of int. It represent the distance from one
- * core to an other. If cores are on the same CPU, their distance is 2, if they
- * are on the same socket, their distance is 4, on the same numa their distance
- * is 6. Otherwise their distance is 8.*/
-static void init_core_distances()
+/* Returns the lowest level of the hierarchy that cores i and j share. */
+static int core_pair_level(int i, int j)
+{
+	struct core_info *ci = &cpu_topology_info.core_list[i];
+	struct core_info *cj = &cpu_topology_info.core_list[j];
+	for (int k = CPU; k < MACHINE; k++) {
+		if (get_node_id(ci, k) == get_node_id(cj, k))
+			return k;
+	}
+	return MACHINE;
+}
+
+#ifdef CONFIG_SCHED_SKU
+/* A copy of core_distance with constant dimensions, so that indexing it
+ * takes neither a row pointer nor a multiplication. */
+static int sku_distance[SKU_NUM_CORES][SKU_NUM_CORES];
+
+static void sku_copy_distances()
+{
+	if (!sku_match)
+		return;
+	for (int i = 0; i < SKU_NUM_CORES; i++)
+		memcpy(sku_distance[i], core_distance[i], sizeof(sku_distance[i]));
+}
+#else
+static int sku_distance[1][1];
+#define sku_copy_distances()
+#endif
+
+/* Returns the distance between cores i and j (by core_id). */
+static inline int pair_distance(int i, int j)
+{
+	if (sku_match)
+		return sku_distance[i][j];
+	return core_distance[i][j];
+}
+
+/* Allocate and fill the rows of our core_distance matrix for cores first
+ * to last - 1, on the memory of OS NUMA node 'node' if it is not -1. A row
+ * holds the distance from one core to every other one. If cores are on the
+ * same CPU, their distance is 2, if they are on the same socket, their
+ * distance is 4, on the same numa their distance is 6. Otherwise their
+ * distance is 8. These defaults can be replaced by measured latencies with
+ * calibrate_core_distances(). */
+static void init_core_distances(int first, int last, int node)
+{
+	size_t size = (size_t)(last - first) * num_cores * sizeof(int);
+	int *rows = node >= 0 ? numa_alloc_onnode(size, node) : malloc(size);
+	if (rows == NULL)
+		exit(-1);
+	for (int i = first; i < last; i++) {
+		core_distance[i] = rows + (size_t)(i - first) * num_cores;
+		for (int j = 0; j < num_cores; j++)
+			core_distance[i][j] = core_pair_level(i, j);
+	}
+}
+
+static int neighbor_cmp(const void *a, const void *b, void *row)
+{
+	int i = *(const uint16_t *)a, j = *(const uint16_t *)b;
+	int di = ((int *)row)[i], dj = ((int *)row)[j];
+	if (di != dj)
+		return di < dj ? -1 : 1;
+	return i - j;
+}
+
+/* Append the cores of node n (or of the machine if n is NULL) outside of
+ * its child 'below' to order, as the run of cores at distance d. */
+static int append_run(struct core_neighbors *nb, int end,
+                      struct sched_pnode *n, struct sched_pnode *below, int d)
+{
+	int first = n ? n->first_core : 0;
+	int last = n ? n->first_core + n->nr_cores : num_cores;
+	for (int j = first; j < last; j++) {
+		if (j == below->first_core)
+			j += below->nr_cores - 1;
+		else
+			nb->order[end++] = j;
+	}
+	if (end > (nb->nr_runs ? nb->runs[nb->nr_runs - 1].end : 0))
+		nb->runs[nb->nr_runs++] = (struct neighbor_run){d, end};
+	return end;
+}
+
+/* Build the neighbor order of core i into nb from its row of distances.
+ * While distances are still the level of the lowest node two cores share
+ * (row is NULL), walking up the core's ancestors yields its order and runs
+ * directly, without sorting. */
+static void build_neighbors(struct core_neighbors *nb, int i, int *row)
 {
-	core_distance = calloc(num_cores, sizeof(int*));
-	if (core_distance == NULL)
+	struct neighbor_run runs[num_cores];
+
+	if (nb->order == NULL &&
+	    (nb->order = malloc(num_cores * sizeof(uint16_t))) == NULL)
+		exit(-1);
+	free(nb->runs);
+	nb->runs = runs;
+	nb->nr_runs = 0;
+	if (row == NULL) {
+		struct sched_pnode *below = core_list[i].spn;
+		int end = 0;
+		for (struct sched_pnode *a = below->parent; a; a = a->parent) {
+			end = append_run(nb, end, a, below, a->type);
+			below = a;
+		}
+		append_run(nb, end, NULL, below, MACHINE);
+	} else {
+		int n = 0;
+		for (int j = 0; j < num_cores; j++) {
+			if (j != i)
+				nb->order[n++] = j;
+		}
+		qsort_r(nb->order, n, sizeof(uint16_t), neighbor_cmp, row);
+		for (int j = 0; j < n; j++) {
+			int d = row[nb->order[j]];
+			if (nb->nr_runs == 0 || runs[nb->nr_runs - 1].distance != d)
+				runs[nb->nr_runs++].distance = d;
+			runs[nb->nr_runs - 1].end = j + 1;
+		}
+	}
+	nb->runs = malloc((nb->nr_runs ? nb->nr_runs : 1) * sizeof(*runs));
+	if (nb->runs == NULL)
 		exit(-1);
+	memcpy(nb->runs, runs, nb->nr_runs * sizeof(*runs));
+}
+
+/* Replace core_distance with matrix, num_cores rows of num_cores distances.
+ * Allocations may be placing cores meanwhile, so the neighbor orders of the
+ * new distances are built aside, and both are put in place in a single
+ * locked section. The rows stay on their NUMA nodes. Returns 0, or -1 if we
+ * run out of memory. */
+static int install_distances(int *matrix)
+{
+	struct core_neighbors *fresh =
+		calloc(num_cores, sizeof(struct core_neighbors));
+	if (fresh == NULL)
+		return -1;
+	for (int i = 0; i < num_cores; i++)
+		build_neighbors(&fresh[i], i, &matrix[i * num_cores]);
+
+	pthread_mutex_lock(&sched_lock);
+	for (int i = 0; i < num_cores; i++)
+		memcpy(core_distance[i], &matrix[i * num_cores],
+		       num_cores * sizeof(int));
+	sku_copy_distances();
+	struct core_neighbors *old = neighbors;
+	neighbors = fresh;
+	pthread_mutex_unlock(&sched_lock);
+
 	for (int i = 0; i < num_cores; i++) {
-		core_distance[i] = calloc(num_cores, sizeof(int));
-		if (core_distance[i] == NULL)
-			exit(-1);
+		free(old[i].order);
+		free(old[i].runs);
+	}
+	free(old);
+	return 0;
+}
+
+/* Replace our level based core distances with the round trip latency (in ns)
+ * of a cache line bounced between every pair of cores. If 'stride' is greater
+ * than 1, only pairs with (i + j) % stride == 0 are measured, and the
+ * remaining pairs get the average latency measured at their level of the
+ * hierarchy. Pairs of cores under the same CPU are always measured, since
+ * they are cheap and the most likely to differ from their neighbors. The
+ * distances are left alone if we run out of memory. */
+void calibrate_core_distances(int stride)
+{
+	long level_sum[NUM_NODE_TYPES] = {0};
+	int level_count[NUM_NODE_TYPES] = {0};
+	struct core_info *ci = cpu_topology_info.core_list;
+
+	if (stride < 1)
+		stride = 1;
+
+	/* Mark every pair as unmeasured, then measure the ones we sample. Core
+	 * distances are indexed by topology core_id, while pinning is done by
+	 * the OS core number. */
+	int *measured = calloc((size_t)num_cores * num_cores, sizeof(int));
+	if (measured == NULL)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		for (int j = i + 1; j < num_cores; j++) {
+			int ci_id = ci[i].core_id, cj_id = ci[j].core_id;
+			int level = core_pair_level(ci_id, cj_id);
+			if (level != CPU && (i + j) % stride != 0)
+				continue;
+			int lat = measure_core_latency(ci[i].os_id, ci[j].os_id,
+			                               CALIBRATION_ITERATIONS);
+			if (lat < 1)
+				lat = 1;
+			measured[ci_id * num_cores + cj_id] =
+				measured[cj_id * num_cores + ci_id] = lat;
+			level_sum[level] += lat;
+			level_count[level]++;
+		}
+	}
+
+	/* Levels with no samples inherit the average of the level below them,
+	 * so the fill-in values never decrease as we go up the hierarchy. */
+	int level_avg[NUM_NODE_TYPES] = {0};
+	for (int k = CPU; k <= MACHINE; k++) {
+		if (level_count[k])
+			level_avg[k] = level_sum[k] / level_count[k];
+		else
+			level_avg[k] = (k == CPU) ? 1 : level_avg[k - 1];
 	}
+
+	/* Fill in the new matrix in place of the samples. */
 	for (int i = 0; i < num_cores; i++) {
+		int *row = &measured[i * num_cores];
 		for (int j = 0; j < num_cores; j++) {
-			for (int k = CPU; k<= MACHINE; k++) {
-				if (i/num_descendants[k][CORE] ==
-					j/num_descendants[k][CORE]) {
-					core_distance[i][j] = k;
-					break;
-				}
-			}
+			if (i == j)
+				row[j] = 1;
+			else if (row[j] == 0)
+				row[j] = level_avg[core_pair_level(i, j)];
+		}
+	}
+	install_distances(measured);
+	free(measured);
+}
+
+/* Write our core_distance matrix to 'path'. The file starts with the number
+ * of cores and the apic id of each core, so that a cached matrix is never
+ * loaded on a machine it was not measured on. Returns 0 on success. */
+int save_core_distances(const char *path)
+{
+	int *matrix = malloc((size_t)num_cores * num_cores * sizeof(int));
+	if (matrix == NULL)
+		return -1;
+	pthread_mutex_lock(&sched_lock);
+	for (int i = 0; i < num_cores; i++)
+		memcpy(&matrix[i * num_cores], core_distance[i],
+		       num_cores * sizeof(int));
+	pthread_mutex_unlock(&sched_lock);
+
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		free(matrix);
+		return -1;
+	}
+	fprintf(f, "%d\n", num_cores);
+	for (int i = 0; i < num_cores; i++)
+		fprintf(f, "%d ", cpu_topology_info.core_list[i].apic_id);
+	fprintf(f, "\n");
+	for (int i = 0; i < num_cores; i++) {
+		for (int j = 0; j < num_cores; j++)
+			fprintf(f, "%d ", matrix[i * num_cores + j]);
+		fprintf(f, "\n");
+	}
+	free(matrix);
+	return fclose(f) ? -1 : 0;
+}
+
+/* Load a core_distance matrix written by save_core_distances(). Our current
+ * distances are only replaced if the whole file matches this machine.
+ * Returns 0 on success. */
+int load_core_distances(const char *path)
+{
+	int n, val, ret = -1;
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &n) != 1 || n != num_cores)
+		goto out;
+	for (int i = 0; i < num_cores; i++) {
+		if (fscanf(f, "%d", &val) != 1 ||
+		    val != cpu_topology_info.core_list[i].apic_id)
+			goto out;
+	}
+	int *matrix = malloc(num_cores * num_cores * sizeof(int));
+	if (matrix == NULL)
+		goto out;
+	for (int i = 0; i < num_cores * num_cores; i++) {
+		if (fscanf(f, "%d", &matrix[i]) != 1 || matrix[i] < 1) {
+			free(matrix);
+			goto out;
+		}
+	}
+	ret = install_distances(matrix);
+	free(matrix);
+out:
+	fclose(f);
+	return ret;
+}
+
+/* Recount the cores of each class below every node, and rebuild the list of
+ * isolated cores. */
+static void count_core_classes()
+{
+	for (int i = 0; i < total_nodes; i++) {
+		memset(node_list[i].class_cores, 0, sizeof(node_list[i].class_cores));
+		memset(node_list[i].class_alloc, 0, sizeof(node_list[i].class_alloc));
+	}
+	memset(class_total, 0, sizeof(class_total));
+	memset(class_used, 0, sizeof(class_used));
+	num_isolated = 0;
+	for (int i = 0; i < num_cores; i++) {
+		struct sched_pcore *c = &core_list[i];
+		int cls = c->core_class;
+		for (struct sched_pnode *n = c->spn; n; n = n->parent) {
+			n->class_cores[cls]++;
+			if (c->alloc_proc != NULL)
+				n->class_alloc[cls]++;
 		}
+		class_total[cls]++;
+		if (c->alloc_proc != NULL)
+			class_used[cls]++;
+		if (cls == CLASS_ISOLATED)
+			isolated_list[num_isolated++] = i;
+	}
+}
+
+/* Account for core c being allocated (delta 1) or freed (delta -1) in the
+ * per class counts of all its ancestors. */
+static void account_core_class(struct sched_pcore *c, int delta)
+{
+	for (struct sched_pnode *n = c->spn; n; n = n->parent)
+		n->class_alloc[c->core_class] += delta;
+	class_used[c->core_class] += delta;
+}
+
+/* Set the cpu mask of every node above cores first to last - 1 to the OS
+ * cores below it, so threads can be pinned to any subtree with a single
+ * call. */
+static void init_node_masks(int first, int last)
+{
+	for (int i = first; i < last; i++) {
+		int os_id = core_list[i].spc_info->os_id;
+		if (os_id < 0 || os_id >= CPU_SETSIZE)
+			continue;
+		for (struct sched_pnode *n = core_list[i].spn; n; n = n->parent)
+			CPU_SET(os_id, &n->cpus);
 	}
 }
 
+#ifdef CONFIG_SCHED_SKU
+/* Only use the SKU's constants if every level of this machine has exactly
+ * the SKU's fan-out. Largest fan-outs equal to the SKU's with totals equal
+ * to the SKU's leave no room for an irregular node. */
+static void sku_check()
+{
+	sku_match = num_numa == SKU_NUM_NUMA &&
+	            sockets_per_numa == SKU_SOCKETS_PER_NUMA &&
+	            num_sockets == SKU_NUM_NUMA * SKU_SOCKETS_PER_NUMA &&
+	            cpus_per_socket == SKU_CPUS_PER_SOCKET &&
+	            num_cpus == num_sockets * SKU_CPUS_PER_SOCKET &&
+	            cores_per_cpu == SKU_CORES_PER_CPU &&
+	            num_cores == SKU_NUM_CORES;
+	if (!sku_match)
+		fprintf(stderr, "not a " SKU_NAME " machine, "
+		        "using the generic topology\n");
+}
+#endif
+
+/* The part of our structures below one NUMA node: its cores are the
+ * contiguous range first_core to last_core - 1. */
+struct init_worker {
+	pthread_t thread;
+	bool started;
+	int first_core;
+	int last_core;
+	int os_node;
+	cpu_set_t cpus;
+};
+
+/* Initialize the nodes, cores and distance rows below one NUMA node. The
+ * subtrees of NUMA nodes are disjoint, so workers need no locking. */
+static void *init_subtree(void *arg)
+{
+	struct init_worker *w = arg;
+	struct core_info *first = &cpu_topology_info.core_list[w->first_core];
+	struct core_info *last = &cpu_topology_info.core_list[w->last_core - 1];
+
+	for (int k = CORE; k < MACHINE; k++)
+		init_nodes(k, get_node_id(first, k), get_node_id(last, k));
+	link_nodes(w->first_core, w->last_core);
+	init_node_masks(w->first_core, w->last_core);
+	init_core_distances(w->first_core, w->last_core, w->os_node);
+	for (int i = w->first_core; i < w->last_core; i++)
+		build_neighbors(&neighbors[i], i, NULL);
+	return NULL;
+}
 
 /* Build our available nodes structure. */
 void nodes_init()
 {
-	/* Allocate a flat array of nodes. */
+#ifdef CONFIG_SCHED_SKU
+	sku_check();
+#endif
+	/* Allocate a flat array of nodes. Its pages are left untouched here, so
+	 * that each ends up on the NUMA node of the worker touching it first. */
 	total_nodes = num_cores + num_cpus + num_sockets + num_numa;
-	void *nodes_and_cores = malloc(total_nodes * sizeof(struct sched_pnode) +
-	                               num_cores * sizeof(struct sched_pcore));
+	size_t size = total_nodes * sizeof(struct sched_pnode) +
+	              num_cores * sizeof(struct sched_pcore);
+	bool have_numa = numa_available() >= 0;
+	void *nodes_and_cores = have_numa ? numa_alloc(size) : malloc(size);
+	if (nodes_and_cores == NULL || (core_distance =
+	    calloc(num_cores, sizeof(int*))) == NULL || (neighbors =
+	    calloc(num_cores, sizeof(struct core_neighbors))) == NULL)
+		exit(-1);
 	node_list = nodes_and_cores;
 	core_list = nodes_and_cores + total_nodes * sizeof(struct sched_pnode);
+	init_lookup(CORE, num_cores);
+	init_lookup(CPU, num_cpus);
+	init_lookup(SOCKET, num_sockets);
+	init_lookup(NUMA, num_numa);
+
+	/* Initialize the nodes of each NUMA node in our hierarchy, link them up
+	 * following the actual topology and compute their distance rows. Each
+	 * NUMA node gets a worker, running on its cores when we may use them,
+	 * so that its state is built in parallel and in local memory. */
+	struct init_worker *workers = calloc(num_numa,
+	                                     sizeof(struct init_worker));
+	if (workers == NULL)
+		exit(-1);
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		CPU_ZERO(&allowed);
+	for (int i = 0; i < num_cores; i++) {
+		struct core_info *ci = &cpu_topology_info.core_list[i];
+		struct init_worker *w = &workers[ci->numa_id];
+		if (w->last_core == 0) {
+			w->first_core = i;
+			w->os_node = have_numa ? numa_node_of_cpu(ci->os_id) : -1;
+		}
+		w->last_core = i + 1;
+		if (ci->os_id >= 0 && ci->os_id < CPU_SETSIZE &&
+		    CPU_ISSET(ci->os_id, &allowed))
+			CPU_SET(ci->os_id, &w->cpus);
+	}
+	for (int n = 0; n < num_numa; n++) {
+		struct init_worker *w = &workers[n];
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (CPU_COUNT(&w->cpus))
+			pthread_attr_setaffinity_np(&attr, sizeof(w->cpus), &w->cpus);
+		w->started = num_numa > 1 &&
+		             pthread_create(&w->thread, &attr, init_subtree, w) == 0;
+		if (!w->started)
+			init_subtree(w);
+		pthread_attr_destroy(&attr);
+	}
+	CPU_ZERO(&machine_cpus);
+	for (int n = 0; n < num_numa; n++) {
+		if (workers[n].started)
+			pthread_join(workers[n].thread, NULL);
+		CPU_OR(&machine_cpus, &machine_cpus, &node_lookup[NUMA][n].cpus);
+	}
+	free(workers);
+
+	isolated_list = malloc(num_cores * sizeof(int));
+	if (isolated_list == NULL)
+		exit(-1);
+	count_core_classes();
+	core_map_words = (num_cores + 63) / 64;
+	sku_copy_distances();
+
+	numa_bandwidth = calloc(num_numa, sizeof(int));
+	numa_bandwidth_used = calloc(num_numa, sizeof(int));
+	if (numa_bandwidth == NULL || numa_bandwidth_used == NULL)
+		exit(-1);
+}
+
+/* Double the number of proc slots, growing the proc_map of every node. */
+static void grow_slots()
+{
+	int words = proc_map_words ? 2 * proc_map_words : 1;
+	slot_procs = realloc(slot_procs, words * 64 * sizeof(struct proc *));
+	free_slots = realloc(free_slots, words * 64 * sizeof(int));
+	if (slot_procs == NULL || free_slots == NULL)
+		exit(-1);
+	for (int i = 0; i < total_nodes; i++) {
+		struct sched_pnode *n = &node_list[i];
+		n->proc_map = realloc(n->proc_map, words * sizeof(uint64_t));
+		if (n->proc_map == NULL)
+			exit(-1);
+		memset(n->proc_map + proc_map_words, 0,
+		       (words - proc_map_words) * sizeof(uint64_t));
+	}
+	proc_map_words = words;
+}
+
+/* Hand out a free proc slot to p, with the lock held. */
+static int get_slot(struct proc *p)
+{
+	int slot;
+	if (num_free_slots > 0) {
+		slot = free_slots[--num_free_slots];
+	} else {
+		if (num_slots == proc_map_words * 64)
+			grow_slots();
+		slot = num_slots++;
+	}
+	slot_procs[slot] = p;
+	return slot;
+}
+
+/* Initialize the scheduler specific fields of a proc. */
+void sched_proc_init(struct proc *p)
+{
+	STAILQ_INIT(&p->ksched_data.alloc_me);
+	STAILQ_INIT(&p->ksched_data.prov_alloc_me);
+	STAILQ_INIT(&p->ksched_data.prov_not_alloc_me);
+	p->ksched_data.bw_demand = 0;
+	p->ksched_data.core_class = CLASS_GENERAL;
+	p->ksched_data.near_node = NULL;
+	CPU_ZERO(&p->ksched_data.alloc_cpus);
+	p->ksched_data.alloc_map = calloc(2 * core_map_words, sizeof(uint64_t));
+	if (p->ksched_data.alloc_map == NULL)
+		exit(-1);
+	p->ksched_data.prov_map = p->ksched_data.alloc_map + core_map_words;
+	pthread_mutex_lock(&sched_lock);
+	p->ksched_data.slot = get_slot(p);
+	LIST_INSERT_HEAD(&all_procs, p, ksched_data.proc_link);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+/* Set the local memory bandwidth (in MB/s) available on a NUMA node. */
+void set_numa_bandwidth(int numa_id, int mbps)
+{
+	if (numa_id >= 0 && numa_id < num_numa)
+		numa_bandwidth[numa_id] = mbps;
+}
+
+/* Set the percentage of each NUMA node's bandwidth that may be claimed by
+ * procs before we start spreading them to other nodes. */
+void set_bandwidth_limit(int percent)
+{
+	bandwidth_limit = percent;
+}
+
+/* Declare the memory bandwidth (in MB/s) each core of proc p consumes. This
+ * only affects cores allocated after the call. */
+void set_proc_bandwidth(struct proc *p, int mbps_per_core)
+{
+	pthread_mutex_lock(&sched_lock);
+	journal_record(JOURNAL_BANDWIDTH, p->pid, mbps_per_core);
+	p->ksched_data.bw_demand = mbps_per_core;
+	pthread_mutex_unlock(&sched_lock);
+}
+
+/* Returns the bandwidth (in MB/s) currently charged to a NUMA node by the
+ * cores allocated on it, or -1 if there is no such node. */
+int sched_bandwidth_used(int numa_id)
+{
+	if (numa_id < 0 || numa_id >= num_numa)
+		return -1;
+	pthread_mutex_lock(&sched_lock);
+	int used = numa_bandwidth_used[numa_id];
+	pthread_mutex_unlock(&sched_lock);
+	return used;
+}
+
+/* Returns our NUMA node whose cores sit on OS NUMA node os_node, or NULL if
+ * there is none. */
+static struct sched_pnode *find_os_numa_node(int os_node)
+{
+	if (os_node < 0 || numa_available() < 0)
+		return NULL;
+	for (int i = 0; i < num_nodes[NUMA]; i++) {
+		struct sched_pnode *n = &node_lookup[NUMA][i];
+		int os_id = core_list[n->first_core].spc_info->os_id;
+		if (numa_node_of_cpu(os_id) == os_node)
+			return n;
+	}
+	return NULL;
+}
+
+/* Returns the smallest socket or NUMA node whose cpus hold all of the
+ * (allowed) local cpus of device d, or NULL if d is local to the whole
+ * machine or to none of our cores. Devices without a local cpu list fall
+ * back to the NUMA node their firmware reports. */
+static struct sched_pnode *find_device_node(struct pci_device *d)
+{
+	cpu_set_t local, in_node;
+
+	if (CPU_COUNT(&d->local_cpus) == 0)
+		return find_os_numa_node(d->numa_node);
+	CPU_AND(&local, &d->local_cpus, &machine_cpus);
+	if (CPU_COUNT(&local) == 0)
+		return NULL;
+	for (int k = SOCKET; k <= NUMA; k++) {
+		for (int i = 0; i < num_nodes[k]; i++) {
+			struct sched_pnode *n = &node_lookup[k][i];
+			CPU_AND(&in_node, &local, &n->cpus);
+			if (CPU_EQUAL(&in_node, &local))
+				return n;
+		}
+	}
+	return NULL;
+}
+
+/* Discover the PCI devices below pci_root (or the default sysfs path if
+ * NULL) and attach each of them to the node it is local to. Returns the
+ * number of devices attached, or -1 if pci_root cannot be read. */
+int sched_attach_devices(const char *pci_root)
+{
+	pthread_mutex_lock(&sched_lock);
+	for (int i = 0; i < total_nodes; i++) {
+		while (!STAILQ_EMPTY(&node_list[i].devices)) {
+			struct sched_pdevice *sd = STAILQ_FIRST(&node_list[i].devices);
+			STAILQ_REMOVE_HEAD(&node_list[i].devices, next);
+			free(sd);
+		}
+	}
+	/* Rescan under the lock, as it frees the devices we just detached. */
+	int ndevices = pci_devices_init(pci_root);
+	if (ndevices < 0) {
+		pthread_mutex_unlock(&sched_lock);
+		return -1;
+	}
+	int attached = 0;
+	for (int i = 0; i < ndevices; i++) {
+		struct pci_device *d = get_pci_device(i);
+		struct sched_pnode *n = find_device_node(d);
+		if (n == NULL)
+			continue;
+		struct sched_pdevice *sd = malloc(sizeof(struct sched_pdevice));
+		if (sd == NULL)
+			break;
+		sd->dev = d;
+		sd->spn = n;
+		STAILQ_INSERT_TAIL(&n->devices, sd, next);
+		attached++;
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return attached;
+}
+
+/* Ask for the first cores of proc p to come from the node the given PCI
+ * device is attached to, so its threads share a socket or NUMA node with
+ * the device. Later cores are packed around the first ones as usual. A
+ * NULL device clears the hint. Returns -1 if the device is unknown. */
+int set_proc_device(struct proc *p, const char *device)
+{
+	struct sched_pnode *n = NULL;
+
+	pthread_mutex_lock(&sched_lock);
+	if (device != NULL) {
+		struct pci_device *d = find_pci_device(device);
+		if (d == NULL) {
+			pthread_mutex_unlock(&sched_lock);
+			return -1;
+		}
+		n = find_device_node(d);
+	}
+	p->ksched_data.near_node = n;
+	pthread_mutex_unlock(&sched_lock);
+	return 0;
+}
+
+/* Move the cores whose OS ids are in os_cpus to the isolated class, and all
+ * others to the general one. Isolated cores are only ever handed out to
+ * procs of the isolated class, and vice versa. Cores keep their current
+ * owner. Returns the number of isolated cores. */
+int sched_set_isolated(const cpu_set_t *os_cpus)
+{
+	pthread_mutex_lock(&sched_lock);
+	for (int i = 0; i < num_cores; i++) {
+		int os_id = core_list[i].spc_info->os_id;
+		bool isolated = os_id >= 0 && os_id < CPU_SETSIZE &&
+		                CPU_ISSET(os_id, os_cpus);
+		core_list[i].core_class = isolated ? CLASS_ISOLATED : CLASS_GENERAL;
+	}
+	count_core_classes();
+	grant_waiters();
+	pthread_mutex_unlock(&sched_lock);
+	return num_isolated;
+}
+
+/* Set the class of cores proc p is given from now on. */
+void set_proc_class(struct proc *p, enum core_class core_class)
+{
+	pthread_mutex_lock(&sched_lock);
+	journal_record(JOURNAL_CLASS, p->pid, core_class);
+	p->ksched_data.core_class = core_class;
+	grant_waiters();
+	pthread_mutex_unlock(&sched_lock);
+}
+
+/* Set how much the sampled load of a core weighs against its distance when
+ * picking cores for a proc, see load_weight. */
+void set_load_weight(int weight)
+{
+	load_weight = weight > 0 ? weight : 0;
+}
+
+/* Set how much turbo headroom weighs against locality, see turbo_weight. */
+void set_turbo_weight(int weight)
+{
+	turbo_weight = weight > 0 ? weight : 0;
+}
 
-	/* Initialize the number of descendants from our cpu_topology info. */
-	num_descendants[CPU][CORE] = cores_per_cpu;
-	num_descendants[SOCKET][CORE] = cores_per_socket;
-	num_descendants[SOCKET][CPU] = cpus_per_socket;
-	num_descendants[NUMA][CORE] = cores_per_numa;
-	num_descendants[NUMA][CPU] = cpus_per_numa;
-	num_descendants[NUMA][SOCKET] = sockets_per_numa;
-	num_descendants[MACHINE][CORE] = num_cores;
-	num_descendants[MACHINE][CPU] = num_cpus;
-	num_descendants[MACHINE][SOCKET] = num_sockets;
-	num_descendants[MACHINE][NUMA] = num_numa;
+/* Returns the clock (kHz) we expect core c to run at with 'active' busy
+ * cores on its socket, or 0 if we do not know its clocks. We model all-core
+ * turbo as falling linearly from the max clock with one busy core to the
+ * base clock with every core of the socket busy. */
+static int expected_khz(struct sched_pcore *c, int active)
+{
+	int os_id = c->spc_info->os_id;
+	if (os_id < 0 || os_id >= CPU_SETSIZE)
+		return 0;
+	struct core_freq *f = &core_freq_list[os_id];
+	struct sched_pnode *socket = &node_lookup[SOCKET][c->spc_info->socket_id];
+	if (socket->nr_cores <= 1 || active <= 1)
+		return f->max_khz;
+	if (active > socket->nr_cores)
+		active = socket->nr_cores;
+	return f->max_khz - (long)(f->max_khz - f->base_khz) * (active - 1) /
+	                    (socket->nr_cores - 1);
+}
+
+/* Returns the percentage of its max clock core c is expected to lose once
+ * it is busy along with the cores already busy on its socket. */
+static int turbo_loss(struct sched_pcore *c)
+{
+	int os_id = c->spc_info->os_id;
+	if (os_id < 0 || os_id >= CPU_SETSIZE || core_freq_list[os_id].max_khz == 0)
+		return 0;
+	int active = node_lookup[SOCKET][c->spc_info->socket_id].refcount[CORE];
+	int max_khz = core_freq_list[os_id].max_khz;
+	return (long)(max_khz - expected_khz(c, active + 1)) * 100 / max_khz;
+}
+
+/* Set the LLC miss rate (misses per ms per core) above which new procs are
+ * kept off a socket. */
+void set_llc_miss_limit(uint64_t per_core_per_ms)
+{
+	llc_miss_limit = per_core_per_ms;
+}
 
-	/* Initialize the nodes at each level in our hierarchy. */
-	init_nodes(CORE, num_cores, 0);
-	init_nodes(CPU, num_cpus, cores_per_cpu);
-	init_nodes(SOCKET, num_sockets, cpus_per_socket);
-	init_nodes(NUMA, num_numa, sockets_per_numa);
+/* Sum the sampled rates of every counter over the cores of node n. */
+static void node_pmu(struct sched_pnode *n, uint64_t *rates)
+{
+	for (int c = 0; c < NUM_PMU_COUNTERS; c++) {
+		rates[c] = 0;
+		for (int i = 0; i < n->nr_cores; i++) {
+			int os_id = core_list[n->first_core + i].spc_info->os_id;
+			rates[c] += core_pmu(c, os_id);
+		}
+	}
+}
 
-	/* Initialize our 2 dimensions array of core_distance */
-	init_core_distances();
+/* Returns true if the last level cache of node n (a socket) misses more
+ * than our limit allows. */
+static bool llc_is_hot(struct sched_pnode *n)
+{
+	uint64_t rates[NUM_PMU_COUNTERS];
+	if (llc_miss_limit == 0)
+		return false;
+	node_pmu(n, rates);
+	return rates[PMU_LLC_MISSES] > llc_miss_limit * n->nr_cores;
+}
+
+/* Returns the first socket below n (a socket or NUMA node) whose LLC is not
+ * hot, or NULL if there is none. Returns n itself if we do not watch LLC
+ * misses. */
+static struct sched_pnode *cool_socket(struct sched_pnode *n)
+{
+	if (llc_miss_limit == 0)
+		return n;
+	if (n->type == SOCKET)
+		return llc_is_hot(n) ? NULL : n;
+	for (int i = 0; i < n->nr_children; i++) {
+		struct sched_pnode *s = cool_socket(&n->children[i]);
+		if (s != NULL)
+			return s;
+	}
+	return NULL;
 }
 
-/* Returns the first core for the node n. */
-static struct sched_pcore *first_core(struct sched_pnode *n)
+/* Returns true if giving one more core on NUMA node numa_id to proc p keeps
+ * that node's memory controllers below our utilization limit. */
+static bool numa_has_bandwidth(struct proc *p, int numa_id)
 {
-	struct sched_pnode *first_child = n;
-	while (first_child->type != CORE)
-		first_child = &first_child->children[0];
-	return first_child->spc_data;
+	if (p->ksched_data.bw_demand == 0 || numa_bandwidth[numa_id] == 0)
+		return true;
+	return (long)(numa_bandwidth_used[numa_id] + p->ksched_data.bw_demand) *
+	       100 <= (long)numa_bandwidth[numa_id] * bandwidth_limit;
 }
 
 /* Returns the core_distance of one core from the list of cores in parameter */
@@ -178,7 +1097,7 @@ static int calc_core_distance(struct sched_pcore_tailq cl,
 	int d = 0;
 	struct sched_pcore *temp = NULL;
 	STAILQ_FOREACH(temp, &cl, alloc_next) {
-		d += core_distance[c->spc_info->core_id][temp->spc_info->core_id];
+		d += pair_distance(c->spc_info->core_id, temp->spc_info->core_id);
 	}
 	return d;
 }
@@ -187,7 +1106,8 @@ static int calc_core_distance(struct sched_pcore_tailq cl,
  * slightly different from find_best_core in the way we just need to check the
  * cores itself, and don't need to check other levels of the topology. If no
  * cores are available we return NULL.*/
-static struct sched_pcore *find_best_core_provision(struct proc *p)
+static struct sched_pcore *find_best_core_provision(struct proc *p,
+                                                    struct sched_search *s)
 {
 	int bestd = 0;
 	struct sched_pcore_tailq core_prov_available = p->ksched_data.
@@ -197,68 +1117,92 @@ static struct sched_pcore *find_best_core_provision(struct proc *p)
 	struct sched_pcore *c = NULL;
 	STAILQ_FOREACH(c, &core_prov_available, prov_next) {
 		int sibd = calc_core_distance(core_alloc, c);
+		s->candidates++;
 		if (bestd == 0 || sibd < bestd) {
 			bestd = sibd;
 			bestc = c;
 		}
 	}
+	s->distance = bestd;
 	return bestc;
 }
 
-#define get_node_id(core_info, level) \
-	((level) == CPU     ? (core_info)->cpu_id : \
-	 (level) == SOCKET  ? (core_info)->socket_id : \
-	 (level) == NUMA    ? (core_info)->numa_id : \
-	 (level) == MACHINE ? 1 : 0)
-
 /* Consider first core provisioned proc by calling find_best_core_provision.
  * Then check siblings of the cores the proc already own. Calculate for
  * every possible node its core_distance (sum of distance from this core to the
- * one the proc owns. Allocate the core that has the lowest core_distance. */
-static struct sched_pcore *find_best_core(struct proc *p)
+ * one the proc owns. Allocate the core that has the lowest core_distance. If
+ * 'spread' is set, cores on NUMA nodes without enough bandwidth left for p
+ * are skipped. */
+static struct sched_pcore *find_best_core(struct proc *p, bool spread,
+                                          struct sched_search *s)
 {
-	struct sched_pcore *bestc = find_best_core_provision(p);
+	struct sched_pcore *bestc = find_best_core_provision(p, s);
 
 	/* If we found an available provisioned core, return it. */
 	if (bestc != NULL)
 		return bestc;
 
-	/* Otherwise, keep looking... */
-	int bestd = 0;
+	/* Otherwise, keep looking... Candidates are scored by their distance to
+	 * the cores p already owns, plus their weighted load and loss of turbo
+	 * headroom. Normally the closest level with a free core wins; when we
+	 * weigh turbo headroom, farther sockets compete too. */
+	int bestd = 0, bests = 0, bestl = 0;
 	struct sched_pcore *c = NULL;
-	int sibling_id = 0;
 	struct sched_pcore_tailq core_owned = p->ksched_data.alloc_me;
 
 	for (int k = CPU; k <= MACHINE; k++) {
+		s->level = k;
 		STAILQ_FOREACH(c, &core_owned, alloc_next) {
-			int nb_cores = num_descendants[k][CORE];
-			int type_id = get_node_id(c->spc_info, k);
+			int first = 0, nb_cores = num_cores;
+			if (sku_match && k != MACHINE) {
+				nb_cores = sku_cores_below(k);
+				first = (unsigned int)c->spc_info->core_id / nb_cores * nb_cores;
+			} else if (k != MACHINE) {
+				struct sched_pnode *n =
+					&node_lookup[k][get_node_id(c->spc_info, k)];
+				first = n->first_core;
+				nb_cores = n->nr_cores;
+			}
 			for (int i = 0; i < nb_cores; i++) {
-				sibling_id = i + nb_cores*type_id;
-				struct sched_pcore *sibc = &core_list[sibling_id];
+				struct sched_pcore *sibc = &core_list[first + i];
+				if (sibc->core_class != p->ksched_data.core_class)
+					continue;
+				if (spread &&
+				    !numa_has_bandwidth(p, sibc->spc_info->numa_id))
+					continue;
 				if (sibc->alloc_proc == NULL) {
+					s->candidates++;
 					int sibd = calc_core_distance(core_owned, sibc);
-					if (bestd == 0 || sibd <= bestd) {
-						/* If the core we have found has best core is
-						 * provisioned by an other proc, we try to find an
-						 * equivalent core (in terms of distance) and allocate
-						 * this core instead. */
-						if (sibd == bestd) {
-							if (bestc->prov_proc != NULL &&
-								sibc->prov_proc == NULL) {
-								bestd = sibd;
-								bestc = sibc;
-							}
-						} else {
+					int sibl = core_load(sibc->spc_info->os_id);
+					int sibs = sibd * 100 + load_weight * sibl +
+					           turbo_weight * turbo_loss(sibc);
+					if (bestc == NULL || sibs < bests) {
+						bestd = sibd;
+						bests = sibs;
+						bestl = sibl;
+						bestc = sibc;
+					} else if (sibs == bests) {
+						/* If the best core we have found is provisioned by
+						 * an other proc, we try to find an equivalent core
+						 * (in terms of score) and allocate this core
+						 * instead. Between equivalent cores, we prefer the
+						 * least loaded one. */
+						bool bestp = bestc->prov_proc != NULL;
+						bool sibp = sibc->prov_proc != NULL;
+						if ((bestp && !sibp) ||
+						    (bestp == sibp && sibl < bestl)) {
 							bestd = sibd;
+							bestl = sibl;
 							bestc = sibc;
 						}
 					}
 				}
 			}
 		}
-		if (bestc != NULL)
+		if (bestc != NULL && (turbo_weight == 0 || k == MACHINE)) {
+			s->distance = bestd;
 			return bestc;
+		}
 	}
 	return NULL;
 }
@@ -269,29 +1213,55 @@ static struct sched_pcore *find_first_provision_core(struct proc *p)
 	return STAILQ_FIRST(&(p->ksched_data.prov_not_alloc_me));
 }
 
+/* Returns the first free core of the given class below node n, or NULL. */
+static struct sched_pcore *first_free_core(struct sched_pnode *n, int cls)
+{
+	for (int i = 0; i < n->nr_cores; i++) {
+		struct sched_pcore *c = &core_list[n->first_core + i];
+		if (c->core_class == cls && c->alloc_proc == NULL)
+			return c;
+	}
+	return NULL;
+}
+
 /* Returns the best first core to allocate for a proc which owns no core.
- * Return the core that is the farthest from the others's proc cores. */
-static struct sched_pcore *find_first_core(struct proc *p)
+ * Return the core that is the farthest from the others's proc cores. The
+ * search is limited to the subtree of 'root', or covers the whole machine
+ * if root is NULL. If 'spread' is set, NUMA nodes without enough bandwidth
+ * left for p are skipped. */
+static struct sched_pcore *find_first_core(struct proc *p,
+                                           struct sched_pnode *root,
+                                           bool spread,
+                                           struct sched_search *s)
 {
 	struct sched_pnode *n = NULL;
 	struct sched_pnode *bestn = NULL;
 	int best_refcount = 0;
-	struct sched_pnode *siblings = node_lookup[MACHINE];
-	int num_siblings = 0;
+	struct sched_pnode *siblings = root ? root : node_lookup[NUMA];
+	int num_siblings = root ? 1 : num_nodes[NUMA];
+	int cls = p->ksched_data.core_class;
 
 	struct sched_pcore *c = find_first_provision_core(p);
 	if (c != NULL)
 		return c;
 
-	for (int i = MACHINE; i >= CORE; i--) {
+	for (int i = root ? root->type : NUMA; i >= CORE; i--) {
 		for (int j = 0; j < num_siblings; j++) {
 			n = &siblings[j];
-			if (n->refcount[CORE] == 0)
-				return first_core(n);
+			struct sched_pnode *start = n;
+			if (spread && i == NUMA && !numa_has_bandwidth(p, n->id))
+				continue;
+			if (spread && i >= SOCKET && (start = cool_socket(n)) == NULL)
+				continue;
+			if (n->class_alloc[cls] == n->class_cores[cls])
+				continue;
+			s->candidates++;
+			if (n->refcount[CORE] == 0 &&
+			    (c = first_free_core(start, cls)) != NULL)
+				return c;
 			if (best_refcount == 0)
 				best_refcount = n->refcount[CORE];
-			if (n->refcount[CORE] <= best_refcount &&
-				n->refcount[CORE] < num_descendants[i][CORE]) {
+			if (n->refcount[CORE] <= best_refcount) {
 				best_refcount = n->refcount[CORE];
 				bestn = n;
 			}
@@ -299,11 +1269,11 @@ static struct sched_pcore *find_first_core(struct proc *p)
 		if (i == CORE || bestn == NULL)
 			break;
 		siblings = bestn->children;
-		num_siblings = num_children(i);
+		num_siblings = bestn->nr_children;
 		best_refcount = 0;
 		bestn = NULL;
 	}
-	return bestn->spc_data;
+	return bestn ? bestn->spc_data : NULL;
 }
 
 /* Recursively incref a node from its level through its ancestors.  At the
@@ -349,19 +1319,41 @@ static void decref_nodes(struct sched_pnode *n)
 	}
 }
 
-/* Allocate a specific core if it is available. In this case, we need to check
- * if the core n is provisioned by p but allocated to an other proc. Then we
- * have to allocate a new core to this other proc. Also, it is important here
+/* Record that core c is allocated to p in p's core map and in the proc map
+ * of every node above c. */
+static void map_core(struct proc *p, struct sched_pcore *c)
+{
+	map_set(p->ksched_data.alloc_map, c->spn->id);
+	for (struct sched_pnode *n = c->spn; n; n = n->parent)
+		map_set(n->proc_map, p->ksched_data.slot);
+}
+
+/* Undo map_core(). Nodes only forget p once it has no core left below
+ * them, and if a node still has one, so do all of its ancestors. */
+static void unmap_core(struct proc *p, struct sched_pcore *c)
+{
+	map_clear(p->ksched_data.alloc_map, c->spn->id);
+	for (struct sched_pnode *n = c->spn; n; n = n->parent) {
+		if (map_any(p->ksched_data.alloc_map, n->first_core, n->nr_cores))
+			break;
+		map_clear(n->proc_map, p->ksched_data.slot);
+	}
+}
+
+/* Allocate a specific core if it is available. In this case, we need to check
+ * if the core n is provisioned by p but allocated to an other proc. Then we
+ * have to allocate a new core to this other proc. Also, it is important here
  * to maintain our list of provision and allocated or not allocated cores.
  * TODO ? : We also have to check if the core n is provisioned by an other proc.
  * In this case, we should try to reprovision an other core to this proc. */
 static struct sched_pcore *alloc_core(struct proc *p, struct sched_pcore *c)
 {
-	struct proc *owner = c->alloc_proc;
-
-	if (c == NULL || owner == p)
+	if (c == NULL || c->alloc_proc == p)
 		return NULL;
 
+	struct proc *owner = c->alloc_proc;
+
+	journal_record(JOURNAL_ALLOC, p->pid, c->spn->id);
 	incref_nodes(c->spn);
 	if (c->prov_proc == p) {
 		STAILQ_REMOVE(&(p->ksched_data.prov_not_alloc_me), c, sched_pcore, prov_next);
@@ -372,19 +1364,39 @@ static struct sched_pcore *alloc_core(struct proc *p, struct sched_pcore *c)
 			STAILQ_REMOVE(&(owner->ksched_data.alloc_me), c, sched_pcore, alloc_next);
 		}
 	}
+	if (owner != NULL) {
+		CPU_CLR(c->spc_info->os_id, &owner->ksched_data.alloc_cpus);
+		unmap_core(owner, c);
+		numa_bandwidth_used[c->spc_info->numa_id] -= c->bw_charged;
+	} else {
+		account_core_class(c, 1);
+	}
+	CPU_SET(c->spc_info->os_id, &p->ksched_data.alloc_cpus);
+	map_core(p, c);
 	c->alloc_proc = p;
+	stats_count(STAT_ALLOCS, 1);
+	c->bw_charged = p->ksched_data.bw_demand;
+	numa_bandwidth_used[c->spc_info->numa_id] += c->bw_charged;
 	return c;
 }
 
 /* Free a specific core. */
 static int free_core(struct proc *p, int core_id)
 {
+	if (core_id < 0 || core_id >= num_cores)
+		return -1;
 	struct sched_pcore *c = &core_list[core_id];
-
-	if (c == NULL || c->alloc_proc != p || core_id > num_cores)
+	if (c->alloc_proc != p)
 		return -1;
 
+	journal_record(JOURNAL_FREE, p->pid, core_id);
 	c->alloc_proc = NULL;
+	account_core_class(c, -1);
+	CPU_CLR(c->spc_info->os_id, &p->ksched_data.alloc_cpus);
+	unmap_core(p, c);
+	stats_count(STAT_FREES, 1);
+	numa_bandwidth_used[c->spc_info->numa_id] -= c->bw_charged;
+	c->bw_charged = 0;
 	STAILQ_REMOVE(&(p->ksched_data.alloc_me), c, sched_pcore, alloc_next);
 	if (c->prov_proc == p){
 		STAILQ_REMOVE(&(p->ksched_data.prov_alloc_me),
@@ -401,79 +1413,1336 @@ static int free_core(struct proc *p, int core_id)
  * increfed in the process, effectively allocating them as well. */
 static struct sched_pcore *alloc_best_core(struct proc *p)
 {
-	return alloc_core(p, find_best_core(p));
+	struct sched_search s = {0};
+	struct sched_pcore *c = find_best_core(p, true, &s);
+	if (c == NULL)
+		c = find_best_core(p, false, &s);
+	c = alloc_core(p, c);
+	stats_count(STAT_SEARCHES, 1);
+	if (s.level > CPU)
+		stats_count(STAT_FALLBACKS, 1);
+	stats_count(STAT_CANDIDATES, s.candidates);
+	if (c != NULL)
+		trace_event(TRACE_ALLOC, p->pid, c->spn->id, s.distance,
+		            s.candidates);
+	return c;
 }
 
+/* Allocates the first core of proc p, from the node of its device if it
+ * asked for one and that node has room, and from the whole machine
+ * otherwise. */
 static struct sched_pcore *alloc_first_core(struct proc *p)
 {
-	return alloc_core(p, find_first_core(p));
+	struct sched_search s = {0};
+	struct sched_pnode *near = p->ksched_data.near_node;
+	struct sched_pcore *c = NULL;
+	if (near != NULL)
+		c = find_first_core(p, near, false, &s);
+	if (c == NULL)
+		c = find_first_core(p, NULL, true, &s);
+	if (c == NULL)
+		c = find_first_core(p, NULL, false, &s);
+	c = alloc_core(p, c);
+	if (c != NULL)
+		trace_event(TRACE_ALLOC, p->pid, c->spn->id, 0, s.candidates);
+	return c;
+}
+
+/* Returns the best isolated core for proc p: one it provisioned if there
+ * is any, otherwise the free one closest to the cores it already owns. The
+ * isolated pool is small, so we scan it directly rather than walking the
+ * tree and its general refcounts. */
+static struct sched_pcore *find_isolated_core(struct proc *p,
+                                              struct sched_search *s)
+{
+	struct sched_pcore_tailq owned = p->ksched_data.alloc_me;
+	struct sched_pcore *bestc = find_best_core_provision(p, s);
+	int bestd = 0;
+
+	if (bestc != NULL)
+		return bestc;
+	for (int i = 0; i < num_isolated; i++) {
+		struct sched_pcore *c = &core_list[isolated_list[i]];
+		if (c->alloc_proc != NULL)
+			continue;
+		s->candidates++;
+		int d = STAILQ_EMPTY(&owned) ? 0 : calc_core_distance(owned, c);
+		if (bestc == NULL || d < bestd ||
+		    (d == bestd && bestc->prov_proc != NULL &&
+		     c->prov_proc == NULL)) {
+			bestc = c;
+			bestd = d;
+		}
+	}
+	s->distance = bestd;
+	return bestc;
+}
+
+static struct sched_pcore *alloc_isolated_core(struct proc *p)
+{
+	struct sched_search s = {0};
+	struct sched_pcore *c = alloc_core(p, find_isolated_core(p, &s));
+	stats_count(STAT_CANDIDATES, s.candidates);
+	if (c != NULL)
+		trace_event(TRACE_ALLOC, p->pid, c->spn->id, s.distance,
+		            s.candidates);
+	return c;
+}
+
+/* Allocate up to amt cores to proc p with the lock held. Returns the number
+ * of cores allocated. */
+static int __alloc_core_any(struct proc *p, int amt)
+{
+	int i = 0;
+	for (; i < amt; i++) {
+		struct sched_pcore *c = NULL;
+		if (p->ksched_data.core_class == CLASS_ISOLATED)
+			c = alloc_isolated_core(p);
+		else if (STAILQ_FIRST(&(p->ksched_data.alloc_me)) == NULL)
+			c = alloc_first_core(p);
+		else
+			c = alloc_best_core(p);
+		if (c == NULL)
+			break;
+		STAILQ_INSERT_TAIL(&p->ksched_data.alloc_me, c, alloc_next);
+	}
+	return i;
 }
 
 /* Allocate an amount of cores for proc p. Those cores are elected according to
- * the algorithm in find_best_core. */
+ * the algorithm in find_best_core, or from the isolated pool for procs of
+ * that class. We stop early if we run out of cores. */
 void alloc_core_any(struct proc *p, int amt)
 {
-	if (amt <= num_cores) {
-		for (int i = 0; i < amt; i++) {
-			struct sched_pcore *c = NULL;
-			if (STAILQ_FIRST(&(p->ksched_data.alloc_me)) == NULL)
-				c = alloc_first_core(p);
-			else
-				c = alloc_best_core(p);
-			STAILQ_INSERT_TAIL(&p->ksched_data.alloc_me, c, alloc_next);
+	uint64_t start = stats_start();
+	pthread_mutex_lock(&sched_lock);
+	__alloc_core_any(p, amt);
+	pthread_mutex_unlock(&sched_lock);
+	stats_record(HIST_ALLOC, start);
+}
+
+/* Returns the number of cores a waiter of p could be given now: the free
+ * cores of its class no other proc provisioned, and the cores p provisioned
+ * that another proc holds, which p may take back. */
+static int waiter_avail(struct proc *p)
+{
+	int cls = p->ksched_data.core_class, n = 0;
+	for (int i = 0; i < num_cores; i++) {
+		struct sched_pcore *c = &core_list[i];
+		if (c->prov_proc == p)
+			n += c->alloc_proc != p;
+		else if (c->prov_proc == NULL && c->alloc_proc == NULL)
+			n += c->core_class == cls;
+	}
+	return n;
+}
+
+/* Mark waiter w done and wake it up. sched_alloc_wait() takes the lock
+ * before returning, but an async caller polling w->state may free w as soon
+ * as it sees it change, so read everything we need first. The futex wake
+ * only uses w's address, and at worst wakes a reuser of it spuriously. */
+static void finish_waiter(struct sched_waiter *w, int state, int result)
+{
+	int efd = w->efd;
+	TAILQ_REMOVE(&waiters, w, next);
+	w->result = result;
+	__atomic_store_n(&w->state, state, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &w->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	if (efd >= 0) {
+		uint64_t one = 1;
+		while (write(efd, &one, sizeof(one)) < 0 && errno == EINTR)
+			;
+	}
+}
+
+/* Give cores to the waiters that can now have them, with the lock held.
+ * A waiter that cannot be served holds back the waiters behind it in its
+ * class, so that small requests do not starve large ones. */
+static void grant_waiters()
+{
+	bool blocked[NUM_CORE_CLASSES] = {false};
+	struct sched_waiter *w, *next;
+	for (w = TAILQ_FIRST(&waiters); w != NULL; w = next) {
+		next = TAILQ_NEXT(w, next);
+		int cls = w->p->ksched_data.core_class;
+		if (blocked[cls])
+			continue;
+		if (waiter_avail(w->p) < w->amt) {
+			blocked[cls] = true;
+			continue;
 		}
+		finish_waiter(w, WAIT_GRANTED, __alloc_core_any(w->p, w->amt));
 	}
 }
 
+/* Cancel the waiters of p, with the lock held. */
+static void cancel_waiters(struct proc *p)
+{
+	struct sched_waiter *w, *next;
+	for (w = TAILQ_FIRST(&waiters); w != NULL; w = next) {
+		next = TAILQ_NEXT(w, next);
+		if (w->p == p)
+			finish_waiter(w, WAIT_CANCELLED, -1);
+	}
+}
+
+/* Queue a request for amt more cores for proc p, granted as a whole once
+ * enough cores are free, possibly right away. w must stay valid until it is
+ * done; its efd (or -1) is signalled once it is. Returns 0, or -1 with errno
+ * set to EINVAL if the machine does not have amt cores p could ever get. */
+int sched_alloc_async(struct sched_waiter *w, struct proc *p, int amt,
+                      int priority, int efd)
+{
+	w->p = p;
+	w->amt = amt;
+	w->priority = priority;
+	w->efd = efd;
+	w->state = WAIT_QUEUED;
+	w->result = -1;
+	pthread_mutex_lock(&sched_lock);
+	int cls = p->ksched_data.core_class;
+	if (amt < 1 || amt > class_total[cls] +
+	    map_count(p->ksched_data.prov_map, 0, num_cores)) {
+		pthread_mutex_unlock(&sched_lock);
+		errno = EINVAL;
+		return -1;
+	}
+	struct sched_waiter *ahead;
+	TAILQ_FOREACH_REVERSE(ahead, &waiters, sched_waiter_list, next) {
+		if (ahead->priority >= priority)
+			break;
+	}
+	if (ahead != NULL)
+		TAILQ_INSERT_AFTER(&waiters, ahead, w, next);
+	else
+		TAILQ_INSERT_HEAD(&waiters, w, next);
+	grant_waiters();
+	pthread_mutex_unlock(&sched_lock);
+	return 0;
+}
+
+/* Withdraw a queued waiter. Returns 0, or -1 if it was already done, in
+ * which case any cores it was granted are p's. */
+int sched_alloc_cancel(struct sched_waiter *w)
+{
+	int ret = -1;
+	pthread_mutex_lock(&sched_lock);
+	if (w->state == WAIT_QUEUED) {
+		finish_waiter(w, WAIT_CANCELLED, -1);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return ret;
+}
+
+/* Allocate amt more cores to proc p, sleeping until they are all free if
+ * need be, or for at most timeout_ms if it is not negative. Returns the
+ * number of cores allocated, or -1 with errno set to EINVAL, ETIMEDOUT, or
+ * ECANCELED if p was destroyed meanwhile. */
+int sched_alloc_wait(struct proc *p, int amt, int priority, int timeout_ms)
+{
+	struct sched_waiter w;
+	struct timespec now, deadline;
+	if (sched_alloc_async(&w, p, amt, priority, -1) < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	while (__atomic_load_n(&w.state, __ATOMIC_ACQUIRE) == WAIT_QUEUED) {
+		struct timespec left, *timeout = NULL;
+		if (timeout_ms >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left.tv_sec = deadline.tv_sec - now.tv_sec;
+			left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (left.tv_nsec < 0) {
+				left.tv_sec--;
+				left.tv_nsec += 1000000000;
+			}
+			if (left.tv_sec < 0)
+				break;
+			timeout = &left;
+		}
+		syscall(SYS_futex, &w.state, FUTEX_WAIT_PRIVATE, WAIT_QUEUED,
+		        timeout, NULL, 0);
+	}
+	pthread_mutex_lock(&sched_lock);
+	bool timed_out = w.state == WAIT_QUEUED;
+	if (timed_out)
+		finish_waiter(&w, WAIT_CANCELLED, -1);
+	pthread_mutex_unlock(&sched_lock);
+	if (w.state == WAIT_CANCELLED)
+		errno = timed_out ? ETIMEDOUT : ECANCELED;
+	return w.result;
+}
+
+static int __free_core_specific(struct proc *p, int core_id)
+{
+	int ret = free_core(p, core_id);
+	if (ret == 0)
+		trace_event(TRACE_FREE, p->pid, core_id, 0, 0);
+	return ret;
+}
+
 int free_core_specific(struct proc* p, int core_id)
 {
-	return free_core(p, core_id);
+	uint64_t start = stats_start();
+	pthread_mutex_lock(&sched_lock);
+	int ret = __free_core_specific(p, core_id);
+	if (ret == 0)
+		grant_waiters();
+	pthread_mutex_unlock(&sched_lock);
+	stats_record(HIST_FREE, start);
+	return ret;
 }
 
 /* Allocate a specific core to the proc p. */
 void alloc_core_specific(struct proc *p, int core_id)
 {
-	if (core_id <= num_cores) {
+	uint64_t start = stats_start();
+	pthread_mutex_lock(&sched_lock);
+	if (core_id >= 0 && core_id < num_cores) {
 		struct sched_pcore *c = &core_list[core_id];
-		if (c->prov_proc == p) {
-			struct sched_pcore *c = alloc_core(p, c);
+		if (c->prov_proc == p && alloc_core(p, c) != NULL) {
 			STAILQ_INSERT_TAIL(&p->ksched_data.alloc_me, c, alloc_next);
+			trace_event(TRACE_ALLOC, p->pid, core_id, 0, 0);
 		}
 	}
+	pthread_mutex_unlock(&sched_lock);
+	stats_record(HIST_ALLOC, start);
 }
 
 /* Remove the provision made by a proc for a core. */
 static void deprovision_core(struct sched_pcore *c)
 {
 	struct proc *p = c-> prov_proc;
+	journal_record(JOURNAL_DEPROVISION, p->pid, c->spn->id);
 	c->prov_proc = NULL;
+	map_clear(p->ksched_data.prov_map, c->spn->id);
 	if (c->alloc_proc == p)
 		STAILQ_REMOVE(&(p->ksched_data.prov_alloc_me), c, sched_pcore, prov_next);
 	else
-		STAILQ_REMOVE(&(p->ksched_data.prov_alloc_me),
+		STAILQ_REMOVE(&(p->ksched_data.prov_not_alloc_me),
 					  c, sched_pcore, prov_next);
+	trace_event(TRACE_DEPROVISION, p->pid, c->spn->id, 0, 0);
+}
+
+/* Remove the provision made by proc p for a specific core. Returns -1 if the
+ * core is not provisioned to p. */
+int deprovision_core_specific(struct proc *p, int core_id)
+{
+	int ret = -1;
+	if (core_id < 0 || core_id >= num_cores)
+		return -1;
+	pthread_mutex_lock(&sched_lock);
+	struct sched_pcore *c = &core_list[core_id];
+	if (c->prov_proc == p) {
+		deprovision_core(c);
+		grant_waiters();
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return ret;
+}
+
+static int __provision_core(struct proc *p, int core_id)
+{
+	if (core_id < 0 || core_id >= num_cores)
+		return -1;
+	struct sched_pcore *c = &core_list[core_id];
+	if (c->prov_proc != NULL)
+		deprovision_core(c);
+	journal_record(JOURNAL_PROVISION, p->pid, core_id);
+	c->prov_proc = p;
+	map_set(p->ksched_data.prov_map, core_id);
+	if (c->alloc_proc == p)
+		STAILQ_INSERT_TAIL(&p->ksched_data.prov_alloc_me, c, prov_next);
+	else
+		STAILQ_INSERT_TAIL(&p->ksched_data.prov_not_alloc_me, c, prov_next);
+	stats_count(STAT_PROVISIONS, 1);
+	trace_event(TRACE_PROVISION, p->pid, core_id, 0, 0);
+	return 0;
 }
 
 /* Provision a given core to the proc p. */
 void provision_core(struct proc *p, int core_id)
 {
-	if (core_id <= num_cores) {
-		struct sched_pcore *c = &core_list[core_id];
-		if (c->prov_proc != NULL)
-			deprovision_core(c);
+	uint64_t start = stats_start();
+	pthread_mutex_lock(&sched_lock);
+	__provision_core(p, core_id);
+	pthread_mutex_unlock(&sched_lock);
+	stats_record(HIST_PROVISION, start);
+}
+
+/* Order a batch so frees come first, then provisions, then allocations from
+ * the largest to the smallest. Freed cores are then available to the
+ * batch, and large requests are placed before small ones fragment the
+ * machine. Requests of a kind keep their submission order. */
+static int compare_requests(const void *a, const void *b)
+{
+	const struct sched_request *ra = *(struct sched_request **)a;
+	const struct sched_request *rb = *(struct sched_request **)b;
+	if (ra->op != rb->op)
+		return rb->op - ra->op;
+	if (ra->op == SCHED_ALLOC && ra->arg != rb->arg)
+		return rb->arg - ra->arg;
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+/* Run a batch of requests under a single hold of the lock, placing them
+ * jointly rather than in arrival order (see compare_requests). Each
+ * request's result is set to the number of cores it got for allocations,
+ * and to 0 or -1 otherwise. The array itself is reordered. */
+void sched_run_batch(struct sched_request **reqs, int n)
+{
+	uint64_t start = stats_start();
+	for (int i = 0; i < n; i++)
+		reqs[i]->seq = i;
+	qsort(reqs, n, sizeof(struct sched_request *), compare_requests);
+	pthread_mutex_lock(&sched_lock);
+	for (int i = 0; i < n; i++) {
+		struct sched_request *r = reqs[i];
+		/* Waiters get the cores freed by the batch before its own
+		 * allocations do. */
+		if (r->op != SCHED_FREE && i > 0 && reqs[i - 1]->op == SCHED_FREE)
+			grant_waiters();
+		switch (r->op) {
+		case SCHED_ALLOC:
+			r->result = __alloc_core_any(r->p, r->arg);
+			break;
+		case SCHED_FREE:
+			r->result = __free_core_specific(r->p, r->arg);
+			break;
+		case SCHED_PROVISION:
+			r->result = __provision_core(r->p, r->arg);
+			break;
+		}
+	}
+	if (n > 0 && reqs[n - 1]->op == SCHED_FREE)
+		grant_waiters();
+	pthread_mutex_unlock(&sched_lock);
+	stats_count(STAT_BATCHES, 1);
+	stats_count(STAT_BATCHED, n);
+	stats_record(HIST_BATCH, start);
+}
+
+/* Release everything a proc holds and forget about it. */
+void sched_proc_destroy(struct proc *p)
+{
+	struct sched_pcore *c;
+	pthread_mutex_lock(&sched_lock);
+	cancel_waiters(p);
+	while ((c = STAILQ_FIRST(&p->ksched_data.alloc_me)) != NULL) {
+		free_core(p, c->spn->id);
+		trace_event(TRACE_FREE, p->pid, c->spn->id, 0, 0);
+	}
+	while ((c = STAILQ_FIRST(&p->ksched_data.prov_not_alloc_me)) != NULL)
+		deprovision_core(c);
+	LIST_REMOVE(p, ksched_data.proc_link);
+	slot_procs[p->ksched_data.slot] = NULL;
+	free_slots[num_free_slots++] = p->ksched_data.slot;
+	grant_waiters();
+	pthread_mutex_unlock(&sched_lock);
+	free(p->ksched_data.alloc_map);
+	p->ksched_data.alloc_map = p->ksched_data.prov_map = NULL;
+}
+
+/* A checkpoint file is a checkpoint_header followed, for each proc, by a
+ * checkpoint_proc, the ids of the cores allocated to it in the order of
+ * its alloc_me list, and the ids of the cores it provisioned, in the order
+ * of its prov_alloc_me then prov_not_alloc_me lists. Core ids are 16 bits
+ * wide, so records after the first are only 2-byte aligned and are copied
+ * out of the file before being read. The sequence number is that of the
+ * last journal record the checkpoint covers. */
+#define CHECKPOINT_MAGIC "SCHEDCKP"
+struct checkpoint_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_cores;
+	uint64_t topology_hash;
+	uint64_t seq;
+	uint32_t nr_procs;
+	uint32_t pad;
+};
+
+struct checkpoint_proc {
+	uint32_t pid;
+	int32_t bw_demand;
+	uint16_t core_class;
+	uint16_t nr_alloc;
+	uint16_t nr_prov;
+	uint16_t near_type;     /* NUM_NODE_TYPES if there is no near_node */
+	uint16_t near_id;
+	uint16_t pad;
+};
+
+/* A hash of the ids of every core, so that a checkpoint is only restored
+ * on the machine it was taken on. */
+static uint64_t topology_hash()
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (int i = 0; i < num_cores; i++) {
+		struct core_info *ci = &cpu_topology_info.core_list[i];
+		int ids[] = { ci->apic_id, ci->os_id, ci->numa_id, ci->socket_id,
+		              ci->cpu_id };
+		for (int j = 0; j < sizeof(ids) / sizeof(ids[0]); j++) {
+			h ^= (uint32_t)ids[j];
+			h *= 1099511628211ULL;
+		}
+	}
+	return h;
+}
+
+static int write_proc(FILE *f, struct proc *p)
+{
+	struct sched_proc_data *d = &p->ksched_data;
+	struct checkpoint_proc cp = {
+		.pid = p->pid,
+		.bw_demand = d->bw_demand,
+		.core_class = d->core_class,
+		.near_type = d->near_node ? d->near_node->type : NUM_NODE_TYPES,
+		.near_id = d->near_node ? d->near_node->id : 0,
+	};
+	uint16_t cores[2 * num_cores];
+	struct sched_pcore *c;
+	int n = 0;
+
+	STAILQ_FOREACH(c, &d->alloc_me, alloc_next)
+		cores[n++] = c->spn->id;
+	cp.nr_alloc = n;
+	STAILQ_FOREACH(c, &d->prov_alloc_me, prov_next)
+		cores[n++] = c->spn->id;
+	STAILQ_FOREACH(c, &d->prov_not_alloc_me, prov_next)
+		cores[n++] = c->spn->id;
+	cp.nr_prov = n - cp.nr_alloc;
+	if (fwrite(&cp, sizeof(cp), 1, f) != 1 ||
+	    fwrite(cores, sizeof(uint16_t), n, f) != n)
+		return -1;
+	return 0;
+}
+
+/* Write the allocation and provisioning state of every proc to 'path',
+ * replacing it atomically, and drop the journal records it covers. Returns
+ * 0 on success, or -1 with errno set. */
+int sched_checkpoint(const char *path)
+{
+	char tmp[strlen(path) + 5];
+	struct checkpoint_header h;
+	struct proc *p;
+	int ret = -1;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL)
+		return -1;
+
+	pthread_mutex_lock(&sched_lock);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+	h.version = 2;
+	h.nr_cores = num_cores;
+	h.topology_hash = topology_hash();
+	h.seq = journal_seq;
+	LIST_FOREACH(p, &all_procs, ksched_data.proc_link)
+		h.nr_procs++;
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		goto out;
+	LIST_FOREACH(p, &all_procs, ksched_data.proc_link) {
+		if (write_proc(f, p) != 0)
+			goto out;
+	}
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0 || rename(tmp, path) != 0)
+		goto out;
+	if (journal_enabled)
+		journal_reset();
+	ret = 0;
+out:
+	pthread_mutex_unlock(&sched_lock);
+	fclose(f);
+	if (ret != 0)
+		unlink(tmp);
+	return ret;
+}
+
+/* Recompute the refcounts of every node from the cores allocated below it,
+ * in a single pass up the levels. */
+static void rebuild_refcounts()
+{
+	for (int i = 0; i < num_cores; i++) {
+		struct sched_pnode *n = &node_lookup[CORE][i];
+		memset(n->refcount, 0, sizeof(n->refcount));
+		n->refcount[CORE] = core_list[i].alloc_proc != NULL;
+	}
+	for (int k = CPU; k < MACHINE; k++) {
+		for (int i = 0; i < num_nodes[k]; i++) {
+			struct sched_pnode *n = &node_lookup[k][i];
+			memset(n->refcount, 0, sizeof(n->refcount));
+			for (int j = 0; j < n->nr_children; j++) {
+				for (int t = CORE; t < k; t++)
+					n->refcount[t] += n->children[j].refcount[t];
+			}
+			n->refcount[k] = n->refcount[CORE] > 0;
+		}
+	}
+}
+
+/* Check that a checkpoint read into buf is complete, matches this machine
+ * and gives no core to two procs. Returns the number of procs in it. */
+static int check_checkpoint(char *buf, size_t size)
+{
+	struct checkpoint_header *h = (void *)buf;
+	if (size < sizeof(*h) ||
+	    memcmp(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != 2 || h->nr_cores != num_cores ||
+	    h->topology_hash != topology_hash())
+		return -1;
+
+	char owner[num_cores], provisioner[num_cores];
+	memset(owner, 0, num_cores);
+	memset(provisioner, 0, num_cores);
+	size_t off = sizeof(*h);
+	for (int i = 0; i < h->nr_procs; i++) {
+		struct checkpoint_proc cp;
+		if (off + sizeof(cp) > size)
+			return -1;
+		memcpy(&cp, buf + off, sizeof(cp));
+		off += sizeof(cp);
+		int n = cp.nr_alloc + cp.nr_prov;
+		if (cp.core_class >= NUM_CORE_CLASSES ||
+		    off + n * sizeof(uint16_t) > size)
+			return -1;
+		if (cp.near_type != NUM_NODE_TYPES &&
+		    (cp.near_type >= MACHINE ||
+		     cp.near_id >= num_nodes[cp.near_type]))
+			return -1;
+		uint16_t *cores = (void *)(buf + off);
+		for (int j = 0; j < n; j++) {
+			char *seen = j < cp.nr_alloc ? owner : provisioner;
+			if (cores[j] >= num_cores || seen[cores[j]]++)
+				return -1;
+		}
+		off += n * sizeof(uint16_t);
+	}
+	return off == size ? h->nr_procs : -1;
+}
+
+/* Give p the cores recorded for it in a checkpoint. */
+static void restore_proc(struct proc *p, struct checkpoint_proc *cp,
+                         uint16_t *cores)
+{
+	struct sched_proc_data *d = &p->ksched_data;
+	d->bw_demand = cp->bw_demand;
+	d->core_class = cp->core_class;
+	if (cp->near_type != NUM_NODE_TYPES)
+		d->near_node = &node_lookup[cp->near_type][cp->near_id];
+	for (int j = 0; j < cp->nr_alloc; j++) {
+		struct sched_pcore *c = &core_list[cores[j]];
+		c->alloc_proc = p;
+		STAILQ_INSERT_TAIL(&d->alloc_me, c, alloc_next);
+		CPU_SET(c->spc_info->os_id, &d->alloc_cpus);
+		map_core(p, c);
+		c->bw_charged = d->bw_demand;
+		numa_bandwidth_used[c->spc_info->numa_id] += c->bw_charged;
+	}
+	for (int j = cp->nr_alloc; j < cp->nr_alloc + cp->nr_prov; j++) {
+		struct sched_pcore *c = &core_list[cores[j]];
 		c->prov_proc = p;
+		map_set(d->prov_map, cores[j]);
 		if (c->alloc_proc == p)
-			STAILQ_INSERT_TAIL(&p->ksched_data.prov_alloc_me, c, prov_next);
+			STAILQ_INSERT_TAIL(&d->prov_alloc_me, c, prov_next);
 		else
-			STAILQ_INSERT_TAIL(&p->ksched_data.prov_not_alloc_me, c, prov_next);
+			STAILQ_INSERT_TAIL(&d->prov_not_alloc_me, c, prov_next);
+	}
+}
+
+struct replay_state {
+	struct proc *(*lookup)(int pid, void *arg);
+	void *arg;
+};
+
+/* Redo one journaled change, the way the allocator made it. The lock is
+ * not held while looking up the proc, which may initialize it. */
+static void replay_record(struct journal_record *r, void *arg)
+{
+	struct replay_state *rs = arg;
+	struct proc *p = rs->lookup(r->pid, rs->arg);
+	struct sched_pcore *c = NULL;
+
+	if (p == NULL)
+		return;
+	if (r->op <= JOURNAL_DEPROVISION) {
+		if (r->arg < 0 || r->arg >= num_cores)
+			return;
+		c = &core_list[r->arg];
+	}
+	pthread_mutex_lock(&sched_lock);
+	switch (r->op) {
+	case JOURNAL_ALLOC:
+		if (alloc_core(p, c) != NULL)
+			STAILQ_INSERT_TAIL(&p->ksched_data.alloc_me, c, alloc_next);
+		break;
+	case JOURNAL_FREE:
+		free_core(p, r->arg);
+		break;
+	case JOURNAL_PROVISION:
+		__provision_core(p, r->arg);
+		break;
+	case JOURNAL_DEPROVISION:
+		if (c->prov_proc == p)
+			deprovision_core(c);
+		break;
+	case JOURNAL_CLASS:
+		if (r->arg >= 0 && r->arg < NUM_CORE_CLASSES)
+			p->ksched_data.core_class = r->arg;
+		break;
+	case JOURNAL_BANDWIDTH:
+		p->ksched_data.bw_demand = r->arg;
+		break;
 	}
+	pthread_mutex_unlock(&sched_lock);
+}
+
+/* Rebuild the allocator state from the checkpoint at 'path', then redo the
+ * changes of the journal at 'journal' (if not NULL) that came after it.
+ * 'lookup' returns the proc of a pid, initialized with sched_proc_init()
+ * if it is new to the caller. Nothing may be allocated or provisioned yet.
+ * Refcounts are rebuilt in one pass rather than core by core. Returns the
+ * number of journal records replayed, or -1 with errno set. */
+int sched_restore(const char *path, const char *journal,
+                  struct proc *(*lookup)(int pid, void *arg), void *arg)
+{
+	struct replay_state rs = { lookup, arg };
+	bool journaling = journal_enabled;
+	int ret = -1;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	char *buf = malloc(size > 0 ? size : 1);
+	if (buf == NULL || fread(buf, 1, size, f) != size) {
+		fclose(f);
+		free(buf);
+		return -1;
+	}
+	fclose(f);
+
+	int nprocs = check_checkpoint(buf, size);
+	if (nprocs < 0) {
+		free(buf);
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sched_lock);
+	for (int i = 0; i < num_cores; i++) {
+		if (core_list[i].alloc_proc || core_list[i].prov_proc) {
+			errno = EBUSY;
+			goto out;
+		}
+	}
+	journal_enabled = false;
+	struct checkpoint_header *h = (void *)buf;
+	size_t off = sizeof(*h);
+	for (int i = 0; i < nprocs; i++) {
+		struct checkpoint_proc cp;
+		memcpy(&cp, buf + off, sizeof(cp));
+		uint16_t *cores = (void *)(buf + off + sizeof(cp));
+		off += sizeof(cp) + (cp.nr_alloc + cp.nr_prov) * sizeof(uint16_t);
+		pthread_mutex_unlock(&sched_lock);
+		struct proc *p = lookup(cp.pid, arg);
+		pthread_mutex_lock(&sched_lock);
+		if (p != NULL)
+			restore_proc(p, &cp, cores);
+	}
+	rebuild_refcounts();
+	count_core_classes();
+	if (journal_seq < h->seq)
+		journal_seq = h->seq;
+
+	ret = 0;
+	if (journal != NULL) {
+		pthread_mutex_unlock(&sched_lock);
+		ret = journal_replay(journal, h->seq, replay_record, &rs);
+		if (ret < 0 && errno == ENOENT)
+			ret = 0;
+		pthread_mutex_lock(&sched_lock);
+	}
+	journal_enabled = journaling;
+out:
+	pthread_mutex_unlock(&sched_lock);
+	free(buf);
+	return ret;
+}
+
+/* The spread of a proc: the sum of the distances between all pairs of the
+ * cores it owns. */
+static long proc_spread(struct proc *p)
+{
+	long d = 0;
+	struct sched_pcore *c;
+	STAILQ_FOREACH(c, &p->ksched_data.alloc_me, alloc_next)
+		d += calc_core_distance(p->ksched_data.alloc_me, c);
+	return d / 2;
+}
+
+/* Returns true if core c lies below node n. */
+static inline bool core_in_node(struct sched_pcore *c, struct sched_pnode *n)
+{
+	int id = c->spn->id;
+	return id >= n->first_core && id < n->first_core + n->nr_cores;
+}
+
+/* Find a better home for one of p's cores. The candidate to move is the
+ * core farthest from the rest of p's cores, ignoring the ones p provisioned
+ * itself. Its destination is the free, unprovisioned core closest to the
+ * rest, weighing the turbo headroom it costs like find_best_core() does.
+ * Sockets that are full according to their refcounts are skipped without
+ * looking at their cores. So are the moves the allocator would not make
+ * either: onto another hot socket, onto another NUMA node without the
+ * bandwidth p needs, or out of the node of p's device. Returns the gain in
+ * score, or 0 if no move would help. */
+static long find_compaction_move(struct proc *p, struct sched_pcore **from,
+                                 struct sched_pcore **to)
+{
+	struct sched_pcore_tailq owned = p->ksched_data.alloc_me;
+	struct sched_pcore *c, *worst = NULL;
+	int worstd = 0;
+
+	STAILQ_FOREACH(c, &owned, alloc_next) {
+		if (c->prov_proc == p)
+			continue;
+		int d = calc_core_distance(owned, c) -
+		        pair_distance(c->spc_info->core_id, c->spc_info->core_id);
+		if (worst == NULL || d > worstd) {
+			worst = c;
+			worstd = d;
+		}
+	}
+	if (worst == NULL)
+		return 0;
+
+	struct sched_pcore *best = NULL;
+	long bests = 0, worsts = (long)worstd * 100;
+	int wid = worst->spc_info->core_id;
+	struct sched_pnode *near = p->ksched_data.near_node;
+	if (near != NULL && !core_in_node(worst, near))
+		near = NULL;
+	for (int i = 0; i < num_nodes[SOCKET]; i++) {
+		struct sched_pnode *socket = &node_lookup[SOCKET][i];
+		bool same_socket = i == worst->spc_info->socket_id;
+		if (socket->refcount[CORE] == socket->nr_cores)
+			continue;
+		if (!same_socket && llc_is_hot(socket))
+			continue;
+		for (int j = 0; j < socket->nr_cores; j++) {
+			c = &core_list[socket->first_core + j];
+			if (c->alloc_proc != NULL || c->prov_proc != NULL ||
+			    c->core_class != p->ksched_data.core_class)
+				continue;
+			if (near != NULL && !core_in_node(c, near))
+				continue;
+			int numa_id = c->spc_info->numa_id;
+			if (numa_id != worst->spc_info->numa_id &&
+			    !numa_has_bandwidth(p, numa_id))
+				continue;
+			long sc = (long)(calc_core_distance(owned, c) -
+			                 pair_distance(c->spc_info->core_id, wid)) * 100;
+			if (!same_socket)
+				sc += turbo_weight * turbo_loss(c);
+			if (best == NULL || sc < bests) {
+				best = c;
+				bests = sc;
+			}
+		}
+	}
+	if (best == NULL || bests >= worsts)
+		return 0;
+	*from = worst;
+	*to = best;
+	return worsts - bests;
+}
+
+struct proc_spread {
+	long spread;
+	struct proc *p;
+};
+
+static int compare_spread(const void *a, const void *b)
+{
+	const struct proc_spread *sa = a, *sb = b;
+	return sa->spread < sb->spread ? 1 : sa->spread > sb->spread ? -1 : 0;
+}
+
+/* Run one compaction pass with the lock held. */
+static int __compact_procs(int max_migrations, bool apply,
+                           struct sched_migration *moves)
+{
+	int nprocs = 0, nmoves = 0;
+	struct proc *p;
+
+	LIST_FOREACH(p, &all_procs, ksched_data.proc_link)
+		nprocs++;
+	if (nprocs == 0)
+		return 0;
+
+	/* Visit the most spread out procs first, so a capped pass spends its
+	 * migrations where they help the most. */
+	struct proc_spread *order = malloc(nprocs * sizeof(struct proc_spread));
+	if (order == NULL)
+		return 0;
+	int n = 0;
+	LIST_FOREACH(p, &all_procs, ksched_data.proc_link) {
+		order[n].spread = proc_spread(p);
+		order[n].p = p;
+		n++;
+	}
+	qsort(order, n, sizeof(struct proc_spread), compare_spread);
+
+	for (int i = 0; i < n && nmoves < max_migrations; i++) {
+		p = order[i].p;
+		struct sched_pcore *from, *to;
+		/* Keep moving cores of this proc while it helps. */
+		while (nmoves < max_migrations &&
+		       find_compaction_move(p, &from, &to) > 0) {
+			if (moves) {
+				moves[nmoves].p = p;
+				moves[nmoves].pid = p->pid;
+				moves[nmoves].from_core = from->spn->id;
+				moves[nmoves].to_core = to->spn->id;
+			}
+			nmoves++;
+			if (!apply)
+				break;
+			/* These refund the bandwidth charged for 'from' and charge
+			 * it again for 'to'. */
+			free_core(p, from->spn->id);
+			trace_event(TRACE_FREE, p->pid, from->spn->id, 0, 0);
+			alloc_core(p, to);
+			STAILQ_INSERT_TAIL(&p->ksched_data.alloc_me, to, alloc_next);
+			trace_event(TRACE_ALLOC, p->pid, to->spn->id, 0, 0);
+		}
+	}
+	free(order);
+	return nmoves;
+}
+
+/* Look for core swaps that reduce the spread of procs whose cores ended up
+ * scattered across the machine. At most 'max_migrations' moves are made
+ * (or only proposed, if 'apply' is false), so a single pass never moves
+ * more threads than the caller can afford. If 'moves' is not NULL, it
+ * receives the moves, and must have room for 'max_migrations' entries.
+ * Returns the number of moves. */
+int compact_procs(int max_migrations, bool apply,
+                  struct sched_migration *moves)
+{
+	pthread_mutex_lock(&sched_lock);
+	int n = __compact_procs(max_migrations, apply, moves);
+	pthread_mutex_unlock(&sched_lock);
+	return n;
+}
+
+static void *compaction_loop(void *arg)
+{
+	struct sched_migration moves[compaction_max_migrations];
+	while (compacting) {
+		usleep(compaction_interval_ms * 1000);
+		int n = compact_procs(compaction_max_migrations, true, moves);
+		for (int i = 0; compaction_cb && i < n; i++)
+			compaction_cb(moves[i].pid, moves[i].from_core,
+			              moves[i].to_core);
+	}
+	return NULL;
+}
+
+/* Start a background thread running a compaction pass every 'interval_ms'.
+ * 'cb', if not NULL, is called for every core that was moved, after the
+ * move, so the threads running on it can follow. It runs without the lock
+ * and is given the pid of the proc, which may be destroyed by then. */
+int start_compaction(int interval_ms, int max_migrations,
+                     void (*cb)(int pid, int from_core, int to_core))
+{
+	if (compacting || max_migrations < 1)
+		return -1;
+	compaction_interval_ms = interval_ms > 0 ? interval_ms : 1;
+	compaction_max_migrations = max_migrations;
+	compaction_cb = cb;
+	compacting = true;
+	if (pthread_create(&compaction_thread, NULL, compaction_loop, NULL)) {
+		compacting = false;
+		return -1;
+	}
+	return 0;
+}
+
+void stop_compaction()
+{
+	if (!compacting)
+		return;
+	compacting = false;
+	pthread_join(compaction_thread, NULL);
+}
+
+/* Returns the cpu mask of a node, or of the whole machine, or NULL if there
+ * is no such node. */
+static cpu_set_t *node_cpus(int type, int id)
+{
+	if (type == MACHINE)
+		return &machine_cpus;
+	if (type < CORE || type > MACHINE || id < 0 || id >= num_nodes[type])
+		return NULL;
+	return &node_lookup[type][id].cpus;
+}
+
+/* Pin thread 'tid' (0 for the calling thread) to all cores of the node of
+ * the given type and id. Returns 0 on success. */
+int sched_pin_thread(pid_t tid, int type, int id)
+{
+	cpu_set_t *cpus = node_cpus(type, id);
+	if (cpus == NULL)
+		return -1;
+	return sched_setaffinity(tid, sizeof(cpu_set_t), cpus);
+}
+
+/* Same as sched_pin_thread(), for a pthread. */
+int sched_pin_pthread(pthread_t thread, int type, int id)
+{
+	cpu_set_t *cpus = node_cpus(type, id);
+	if (cpus == NULL)
+		return -1;
+	return pthread_setaffinity_np(thread, sizeof(cpu_set_t), cpus);
+}
+
+/* Pin threads 'tids' to the cores currently allocated to proc p. The mask is
+ * taken once, so the whole group lands on the same allocation even if it
+ * changes meanwhile; callers re-pin after every change (e.g. from the
+ * compaction callback). Returns the number of threads that failed. */
+int sched_pin_threads_to_proc(pid_t *tids, int ntids, struct proc *p)
+{
+	cpu_set_t cpus;
+	int failed = 0;
+
+	pthread_mutex_lock(&sched_lock);
+	cpus = p->ksched_data.alloc_cpus;
+	pthread_mutex_unlock(&sched_lock);
+	if (CPU_COUNT(&cpus) == 0)
+		return ntids;
+	for (int i = 0; i < ntids; i++)
+		if (sched_setaffinity(tids[i], sizeof(cpu_set_t), &cpus) != 0)
+			failed++;
+	return failed;
+}
+
+/* Collect into cand the cores an interrupt consumed by proc p may be sent
+ * to: the cores in the level 'type' subtrees holding p's cores, minus any
+ * core sharing a cpu with one of p's cores and any isolated core. Free
+ * cores come first. Returns the number of cores collected. */
+static int irq_candidates(struct proc *p, int type, int *cand)
+{
+	bool *near = calloc(type == MACHINE ? 1 : num_nodes[type], sizeof(bool));
+	bool *busy_cpu = calloc(num_cpus, sizeof(bool));
+	struct sched_pcore *c;
+
+	STAILQ_FOREACH(c, &p->ksched_data.alloc_me, alloc_next) {
+		near[get_node_id(c->spc_info, type)] = true;
+		busy_cpu[c->spc_info->cpu_id] = true;
+	}
+	int n = 0;
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < num_cores; i++) {
+			c = &core_list[i];
+			if (!near[get_node_id(c->spc_info, type)] ||
+			    busy_cpu[c->spc_info->cpu_id] ||
+			    c->core_class == CLASS_ISOLATED ||
+			    (c->alloc_proc == NULL) != (pass == 0))
+				continue;
+			cand[n++] = i;
+		}
+	}
+	free(near);
+	free(busy_cpu);
+	return n;
+}
+
+/* Plan where the nirqs interrupts of a device used by proc p should be
+ * delivered, storing one OS core per IRQ in os_cores. IRQs are spread over
+ * p's own cores, or, if 'avoid_siblings' is set, over the closest cores
+ * that do not share a cpu with them: first within p's sockets, then its
+ * NUMA nodes, then the whole machine. Returns -1 if p owns no core. */
+int sched_plan_irqs(struct proc *p, int nirqs, bool avoid_siblings,
+                    int *os_cores)
+{
+	int *cand = malloc(num_cores * sizeof(int));
+	int ncand = 0;
+	struct sched_pcore *c;
+
+	pthread_mutex_lock(&sched_lock);
+	if (avoid_siblings) {
+		for (int k = SOCKET; k <= MACHINE && ncand == 0; k++)
+			ncand = irq_candidates(p, k, cand);
+	}
+	if (ncand == 0) {
+		STAILQ_FOREACH(c, &p->ksched_data.alloc_me, alloc_next)
+			cand[ncand++] = c->spn->id;
+	}
+	for (int i = 0; i < nirqs && ncand; i++)
+		os_cores[i] = cpu_topology_info.core_list[cand[i % ncand]].os_id;
+	pthread_mutex_unlock(&sched_lock);
+	free(cand);
+	return ncand ? 0 : -1;
+}
+
+/* Pin thread 'tid' (0 for the calling thread) to the cores currently
+ * allocated to proc p. Returns 0 on success. */
+int sched_pin_thread_to_proc(pid_t tid, struct proc *p)
+{
+	return sched_pin_threads_to_proc(&tid, 1, p) ? -1 : 0;
+}
+
+/* Returns the distance between two cores, as used for placement, or -1 if
+ * either core does not exist. */
+int sched_core_distance(int core_a, int core_b)
+{
+	if (core_a < 0 || core_a >= num_cores || core_b < 0 ||
+	    core_b >= num_cores)
+		return -1;
+	struct sched_pcore *a = &core_list[core_a], *b = &core_list[core_b];
+	pthread_mutex_lock(&sched_lock);
+	int d = pair_distance(a->spc_info->core_id, b->spc_info->core_id);
+	pthread_mutex_unlock(&sched_lock);
+	return d;
+}
+
+/* Returns the number of nodes at a given level of the hierarchy, or -1 if
+ * there is no such level. */
+int sched_num_nodes(int type)
+{
+	if (type < CORE || type >= NUM_NODE_TYPES)
+		return -1;
+	return num_nodes[type];
+}
+
+/* Returns the number of cores allocated to p below node id of the given
+ * type, or of the whole machine, or -1 if there is no such node. */
+int sched_proc_cores_in(struct proc *p, int type, int id)
+{
+	int first = 0, count = num_cores;
+
+	if (type < CORE || type > MACHINE ||
+	    (type != MACHINE && (id < 0 || id >= num_nodes[type])))
+		return -1;
+	if (type != MACHINE) {
+		first = node_lookup[type][id].first_core;
+		count = node_lookup[type][id].nr_cores;
+	}
+	pthread_mutex_lock(&sched_lock);
+	count = map_count(p->ksched_data.alloc_map, first, count);
+	pthread_mutex_unlock(&sched_lock);
+	return count;
+}
+
+/* Returns the number of nodes of the given type that p has cores below. */
+int sched_proc_nodes(struct proc *p, int type)
+{
+	const uint64_t *map = p->ksched_data.alloc_map;
+	int count = 0;
+
+	pthread_mutex_lock(&sched_lock);
+	if (type == CORE) {
+		count = map_count(map, 0, num_cores);
+	} else if (type == MACHINE) {
+		count = map_any(map, 0, num_cores);
+	} else {
+		for (int i = 0; i < num_nodes[type]; i++) {
+			struct sched_pnode *n = &node_lookup[type][i];
+			count += map_any(map, n->first_core, n->nr_cores);
+		}
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return count;
+}
+
+/* Returns the number of nodes of the given type below which both a and b
+ * hold cores, allocated or provisioned. At the CORE level, these are the
+ * cores one of them provisioned while the other one got them allocated. */
+int sched_proc_overlap(struct proc *a, struct proc *b, int type)
+{
+	uint64_t held_a[core_map_words], held_b[core_map_words];
+	pthread_mutex_lock(&sched_lock);
+	for (int w = 0; w < core_map_words; w++) {
+		held_a[w] = a->ksched_data.alloc_map[w] | a->ksched_data.prov_map[w];
+		held_b[w] = b->ksched_data.alloc_map[w] | b->ksched_data.prov_map[w];
+	}
+	pthread_mutex_unlock(&sched_lock);
+	int count = 0;
+	if (type == CORE) {
+		for (int w = 0; w < core_map_words; w++)
+			count += __builtin_popcountll(held_a[w] & held_b[w]);
+	} else if (type == MACHINE) {
+		count = map_any(held_a, 0, num_cores) && map_any(held_b, 0, num_cores);
+	} else {
+		for (int i = 0; i < num_nodes[type]; i++) {
+			struct sched_pnode *n = &node_lookup[type][i];
+			count += map_any(held_a, n->first_core, n->nr_cores) &&
+			         map_any(held_b, n->first_core, n->nr_cores);
+		}
+	}
+	return count;
+}
+
+/* Fill procs with up to max of the procs that have cores allocated below
+ * node id of the given type. Returns how many procs there are in all. */
+int sched_node_procs(int type, int id, struct proc **procs, int max)
+{
+	if (type < CORE || type >= MACHINE || id < 0 || id >= num_nodes[type])
+		return -1;
+	struct sched_pnode *n = &node_lookup[type][id];
+	int count = 0;
+	pthread_mutex_lock(&sched_lock);
+	for (int w = 0; n->proc_map && w < proc_map_words; w++) {
+		for (uint64_t bits = n->proc_map[w]; bits; bits &= bits - 1) {
+			int slot = w * 64 + __builtin_ctzll(bits);
+			if (count < max)
+				procs[count] = slot_procs[slot];
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return count;
+}
+
+static inline bool near_match(int core, enum sched_near filter,
+                              struct proc *p)
+{
+	switch (filter) {
+	case NEAR_FREE:
+		return core_list[core].alloc_proc == NULL;
+	case NEAR_OWNED:
+		return core_list[core].alloc_proc == p;
+	default:
+		return true;
+	}
+}
+
+/* Fill cores with up to k cores nearest to core, nearest first, and
+ * distances (if not NULL) with their distance to it. The core itself comes
+ * first if it passes the filter: NEAR_ANY takes every core, NEAR_FREE only
+ * the unallocated ones and NEAR_OWNED only those allocated to p. Returns
+ * the number of cores found. */
+int sched_nearest_cores(int core, int k, enum sched_near filter,
+                        struct proc *p, int *cores, int *distances)
+{
+	if (core < 0 || core >= num_cores || k < 1)
+		return 0;
+	int found = 0;
+	pthread_mutex_lock(&sched_lock);
+	if (near_match(core, filter, p)) {
+		if (distances)
+			distances[found] = core_distance[core][core];
+		cores[found++] = core;
+	}
+	struct core_neighbors *nb = &neighbors[core];
+	for (int r = 0, i = 0; r < nb->nr_runs && found < k; r++) {
+		for (; i < nb->runs[r].end && found < k; i++) {
+			int c = nb->order[i];
+			if (!near_match(c, filter, p))
+				continue;
+			if (distances)
+				distances[found] = nb->runs[r].distance;
+			cores[found++] = c;
+		}
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return found;
+}
+
+/* Returns the free core nearest to core, or -1 if all cores are taken. */
+int sched_nearest_free_core(int core)
+{
+	int c;
+	return sched_nearest_cores(core, 1, NEAR_FREE, NULL, &c, NULL) ? c : -1;
+}
+
+/* Call fn on every proc, with the lock held. */
+void sched_for_each_proc(void (*fn)(struct proc *p, void *arg), void *arg)
+{
+	struct proc *p;
+	pthread_mutex_lock(&sched_lock);
+	LIST_FOREACH(p, &all_procs, ksched_data.proc_link)
+		fn(p, arg);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+/* Report the number of allocated and total cores of a class. Returns -1 if
+ * there is no such class. */
+int sched_class_usage(int core_class, int *used, int *total)
+{
+	if (core_class < 0 || core_class >= NUM_CORE_CLASSES)
+		return -1;
+	pthread_mutex_lock(&sched_lock);
+	*used = class_used[core_class];
+	*total = class_total[core_class];
+	pthread_mutex_unlock(&sched_lock);
+	return 0;
+}
+
+/* Report the occupancy of a node: the number of its cores that are
+ * allocated, its total number of cores, and the number of free cores that
+ * are stranded under CPUs which already have some cores allocated. Returns
+ * -1 if there is no such node. */
+int sched_node_usage(int type, int id, int *used, int *total, int *stranded)
+{
+	if (type < CORE || type >= MACHINE || id < 0 || id >= num_nodes[type])
+		return -1;
+	struct sched_pnode *n = &node_lookup[type][id];
+	pthread_mutex_lock(&sched_lock);
+	*used = n->refcount[CORE];
+	*total = n->nr_cores;
+	*stranded = 0;
+	/* The CPUs below n are contiguous, starting with the CPU of its first
+	 * core, and hold its nr_cores cores between them. */
+	if (type != CORE) {
+		struct sched_pnode *cpu = core_list[n->first_core].spn->parent;
+		for (int seen = 0; seen < n->nr_cores;
+		     seen += cpu->nr_cores, cpu++) {
+			if (cpu->refcount[CORE] != 0)
+				*stranded += cpu->nr_cores - cpu->refcount[CORE];
+		}
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return 0;
+}
+
+/* Returns the average clock (kHz) the cores of proc p are expected to run
+ * at given how busy their sockets are, or 0 if unknown. */
+int sched_proc_freq(struct proc *p)
+{
+	struct sched_pcore *c;
+	long sum = 0;
+	int n = 0;
+
+	STAILQ_FOREACH(c, &p->ksched_data.alloc_me, alloc_next) {
+		int active = node_lookup[SOCKET][c->spc_info->socket_id].
+		             refcount[CORE];
+		int khz = expected_khz(c, active);
+		if (khz == 0)
+			return 0;
+		sum += khz;
+		n++;
+	}
+	return n ? sum / n : 0;
 }
 
 void print_node(struct sched_pnode *n)
 {
 	printf("%-6s id: %2d, type: %d, num_children: %2d",
 		   node_label[n->type], n->id, n->type,
-		   num_children(n->type));
+		   n->nr_children);
 	for (int i = n->type ; i>-1; i--) {
 		printf(", refcount[%d]: %2d", i, n->refcount[i]);
 	}
@@ -499,17 +2768,36 @@ void print_all_nodes()
 		print_nodes(i);
 }
 
+/* Print the sampled hardware counter rates of every NUMA node, socket and
+ * cpu, per core, flagging the sockets new procs currently avoid. */
+void print_node_pmu()
+{
+	uint64_t rates[NUM_PMU_COUNTERS];
+
+	if (!pmu_available())
+		printf("hardware counters unavailable\n");
+	for (int k = NUMA; k >= CPU; k--) {
+		for (int i = 0; i < num_nodes[k]; i++) {
+			struct sched_pnode *n = &node_lookup[k][i];
+			node_pmu(n, rates);
+			printf("%-6s %2d llc misses/ms/core: %8llu, "
+			       "mem stalls/ms/core: %8llu%s\n", node_label[k], i,
+			       (unsigned long long)rates[PMU_LLC_MISSES] / n->nr_cores,
+			       (unsigned long long)rates[PMU_MEM_STALLS] / n->nr_cores,
+			       k == SOCKET && llc_is_hot(n) ? " (hot)" : "");
+		}
+	}
+}
+
 void test_structure()
 {
 	struct sched_pcore *c = NULL;
 	struct proc *p1 = malloc(sizeof(struct proc));
 	struct proc *p2 = malloc(sizeof(struct proc));
-	STAILQ_INIT(&p1->ksched_data.alloc_me);
-	STAILQ_INIT(&p2->ksched_data.alloc_me);
-	STAILQ_INIT(&p1->ksched_data.prov_alloc_me);
-	STAILQ_INIT(&p2->ksched_data.prov_alloc_me);
-	STAILQ_INIT(&p1->ksched_data.prov_not_alloc_me);
-	STAILQ_INIT(&p2->ksched_data.prov_not_alloc_me);
+	p1->pid = 1;
+	p2->pid = 2;
+	sched_proc_init(p1);
+	sched_proc_init(p2);
 
 	provision_core(p1, 7);
 	alloc_core_any(p1, 3);
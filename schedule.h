@@ -8,12 +8,21 @@
 #ifndef	SCHEDULE_H
 #define	SCHEDULE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include <sys/queue.h>
 #include "topology.h"
+#include "pci.h"
 
 enum node_type { CORE, CPU, SOCKET, NUMA, MACHINE, NUM_NODE_TYPES};
 enum link_type { ALLOC, PROV };
+enum core_class { CLASS_GENERAL, CLASS_ISOLATED, NUM_CORE_CLASSES };
+enum sched_near { NEAR_ANY, NEAR_FREE, NEAR_OWNED };
 static char node_label[5][8] = { "CORE", "CPU", "SOCKET", "NUMA", "MACHINE" };
+static char class_label[NUM_CORE_CLASSES][9] = { "general", "isolated" };
 
 struct sched_pcore {
 	struct sched_pnode *spn;
@@ -22,37 +31,171 @@ struct sched_pcore {
 	STAILQ_ENTRY(sched_pcore) alloc_next;
 	struct proc *alloc_proc;
 	struct proc *prov_proc;
+	enum core_class core_class;
+	/* The bandwidth charged to our NUMA node for this core when it was
+	 * allocated, which is what its release gives back. */
+	int bw_charged;
 };
 STAILQ_HEAD(sched_pcore_tailq, sched_pcore);
 
+/* A PCI device, attached to the smallest socket or NUMA node holding all of
+ * its local cpus. */
+struct sched_pdevice {
+	struct pci_device *dev;
+	struct sched_pnode *spn;
+	STAILQ_ENTRY(sched_pdevice) next;
+};
+STAILQ_HEAD(sched_pdevice_tailq, sched_pdevice);
+
 struct sched_pnode {
 	int id;
 	enum node_type type;
 	int refcount[NUM_NODE_TYPES];
 	struct sched_pnode *parent;
 	struct sched_pnode *children;
+	int nr_children;
+	int first_core;
+	int nr_cores;
+	/* The number of cores of each class below us, and how many of those
+	 * are allocated. */
+	int class_cores[NUM_CORE_CLASSES];
+	int class_alloc[NUM_CORE_CLASSES];
 	struct sched_pcore *spc_data;
+	cpu_set_t cpus;
+	struct sched_pdevice_tailq devices;
+	/* The procs with cores allocated below us, by proc slot. */
+	uint64_t *proc_map;
 };
 
 struct sched_proc_data {
 	struct sched_pcore_tailq alloc_me;
 	struct sched_pcore_tailq prov_alloc_me;
 	struct sched_pcore_tailq prov_not_alloc_me;
+	int bw_demand;
+	enum core_class core_class;
+	struct sched_pnode *near_node;
+	cpu_set_t alloc_cpus;
+	/* The cores allocated to and provisioned by the proc, as bitmaps
+	 * indexed by core id and kept in sync with the lists above. The cores
+	 * below a node are a contiguous range of bits. */
+	uint64_t *alloc_map;
+	uint64_t *prov_map;
+	int slot;
+	LIST_ENTRY(proc) proc_link;
 };
 
 struct proc {
+	int pid;
 	struct sched_proc_data ksched_data;
 };
 
+/* A request run as part of a batch by sched_run_batch(). Ops are listed in
+ * the reverse of the order they run in within a batch. */
+enum sched_op { SCHED_ALLOC, SCHED_PROVISION, SCHED_FREE };
+
+struct sched_request {
+	enum sched_op op;
+	struct proc *p;
+	int arg;                /* cores to allocate, or a core id */
+	int result;
+	int seq;
+	uint64_t submitted;
+	int efd;                /* eventfd signalled when done, or -1 */
+	volatile bool done;
+	struct sched_request *next;
+};
+
+/* A proc waiting for cores to free up, queued by sched_alloc_async().
+ * Waiters are served by decreasing priority, in arrival order among equal
+ * priorities, and get all of their cores at once. */
+enum sched_wait_state { WAIT_QUEUED, WAIT_GRANTED, WAIT_CANCELLED };
+
+struct sched_waiter {
+	struct proc *p;
+	int amt;
+	int priority;
+	int efd;                /* eventfd signalled when done, or -1 */
+	int state;              /* a sched_wait_state, and our futex word */
+	int result;             /* cores granted, or -1 */
+	TAILQ_ENTRY(sched_waiter) next;
+};
+
+/* A core moved from one place to another by the compaction pass. */
+struct sched_migration {
+	struct proc *p;
+	int pid;                /* p's pid, which stays usable once p is gone */
+	int from_core;
+	int to_core;
+};
+
 void nodes_init();
+void sched_proc_init(struct proc *p);
+void sched_proc_destroy(struct proc *p);
 void alloc_core_any(struct proc *p, int amt);
 void alloc_core_specific(struct proc *p, int core_id);
 int free_core_specific(struct proc *p, int core_id);
 void provision_core(struct proc *p, int core_id);
+int deprovision_core_specific(struct proc *p, int core_id);
+void sched_run_batch(struct sched_request **reqs, int n);
+
+int sched_alloc_wait(struct proc *p, int amt, int priority, int timeout_ms);
+int sched_alloc_async(struct sched_waiter *w, struct proc *p, int amt,
+                      int priority, int efd);
+int sched_alloc_cancel(struct sched_waiter *w);
+
+int sched_checkpoint(const char *path);
+int sched_restore(const char *path, const char *journal,
+                  struct proc *(*lookup)(int pid, void *arg), void *arg);
+
+void calibrate_core_distances(int stride);
+int save_core_distances(const char *path);
+int load_core_distances(const char *path);
+
+void set_numa_bandwidth(int numa_id, int mbps);
+void set_bandwidth_limit(int percent);
+void set_proc_bandwidth(struct proc *p, int mbps_per_core);
+int sched_bandwidth_used(int numa_id);
+void set_load_weight(int weight);
+void set_turbo_weight(int weight);
+int sched_set_isolated(const cpu_set_t *os_cpus);
+void set_proc_class(struct proc *p, enum core_class core_class);
+void set_llc_miss_limit(uint64_t per_core_per_ms);
+
+int sched_attach_devices(const char *pci_root);
+int set_proc_device(struct proc *p, const char *device);
+
+int compact_procs(int max_migrations, bool apply,
+                  struct sched_migration *moves);
+int start_compaction(int interval_ms, int max_migrations,
+                     void (*cb)(int pid, int from_core, int to_core));
+void stop_compaction();
+
+int sched_pin_thread(pid_t tid, int type, int id);
+int sched_pin_pthread(pthread_t thread, int type, int id);
+int sched_pin_thread_to_proc(pid_t tid, struct proc *p);
+int sched_pin_threads_to_proc(pid_t *tids, int ntids, struct proc *p);
+
+int sched_plan_irqs(struct proc *p, int nirqs, bool avoid_siblings,
+                    int *os_cores);
+
+int sched_core_distance(int core_a, int core_b);
+int sched_num_nodes(int type);
+int sched_node_usage(int type, int id, int *used, int *total, int *stranded);
+int sched_class_usage(int core_class, int *used, int *total);
+int sched_proc_freq(struct proc *p);
+int sched_proc_cores_in(struct proc *p, int type, int id);
+int sched_proc_nodes(struct proc *p, int type);
+int sched_proc_overlap(struct proc *a, struct proc *b, int type);
+int sched_node_procs(int type, int id, struct proc **procs, int max);
+int sched_nearest_cores(int core, int k, enum sched_near filter,
+                        struct proc *p, int *cores, int *distances);
+int sched_nearest_free_core(int core);
+void sched_for_each_proc(void (*fn)(struct proc *p, void *arg), void *arg);
 
 void print_node(struct sched_pnode *n);
 void print_nodes(int type);
 void print_all_nodes();
+void print_node_pmu();
 void test_structure();
 
 #endif
@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <numa.h>
+#include "topology.h"
+#include "shard.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* How long a freelist user spins on a shard's lock before it starts
+ * yielding its core to the holder. */
+#define SHARD_SPIN_LIMIT 1024
+
+/* The memory of the shards on one NUMA node (or of the machine's only
+ * shard). */
+struct shard_block {
+	void *mem;
+	size_t size;
+	int numa_node;
+};
+
+/* Where the shards of a structure are. Shards are numbered like the nodes
+ * of their level, so the shards below any node of a higher level form a
+ * contiguous range, which starts at first[type][id]. */
+struct shard_layout {
+	enum node_type level;
+	int num_shards;
+	size_t shard_size;
+	void **shard;
+	struct core_info **core;        /* the first core of each shard */
+	int *first[NUM_NODE_TYPES];
+	struct shard_block *blocks;
+	int num_blocks;
+};
+
+static int node_id(struct core_info *c, enum node_type type)
+{
+	switch (type) {
+	case CORE:
+		return c->core_id;
+	case CPU:
+		return c->cpu_id;
+	case SOCKET:
+		return c->socket_id;
+	case NUMA:
+		return c->numa_id;
+	default:
+		return 0;
+	}
+}
+
+static int num_ids(enum node_type type)
+{
+	switch (type) {
+	case CORE:
+		return cpu_topology_info.num_cores;
+	case CPU:
+		return cpu_topology_info.num_cpus;
+	case SOCKET:
+		return cpu_topology_info.num_sockets;
+	case NUMA:
+		return cpu_topology_info.num_numa;
+	default:
+		return 1;
+	}
+}
+
+static void free_layout(struct shard_layout *l)
+{
+	for (int b = 0; l->blocks && b < l->num_blocks; b++) {
+		struct shard_block *block = &l->blocks[b];
+		if (block->mem == NULL)
+			continue;
+		if (block->numa_node >= 0)
+			numa_free(block->mem, block->size);
+		else
+			free(block->mem);
+	}
+	for (int t = CORE; t <= MACHINE; t++)
+		free(l->first[t]);
+	free(l->blocks);
+	free(l->core);
+	free(l->shard);
+}
+
+/* Lay out zeroed shards of 'size' bytes at the given level, each shard on
+ * cache lines of its own and on the memory of its NUMA node. Returns 0 on
+ * success. */
+static int init_layout(struct shard_layout *l, enum node_type level,
+                       size_t size)
+{
+	struct core_info *cores = cpu_topology_info.core_list;
+
+	memset(l, 0, sizeof(*l));
+	if (level < CORE || level > MACHINE)
+		return -1;
+	l->level = level;
+	l->num_shards = num_ids(level);
+	l->shard_size = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+	l->shard = calloc(l->num_shards, sizeof(void *));
+	l->core = calloc(l->num_shards, sizeof(struct core_info *));
+	if (l->shard == NULL || l->core == NULL)
+		return -1;
+	for (int i = cpu_topology_info.num_cores - 1; i >= 0; i--)
+		l->core[node_id(&cores[i], level)] = &cores[i];
+	for (int t = level; t <= MACHINE; t++) {
+		int ids = num_ids(t);
+		if ((l->first[t] = malloc((ids + 1) * sizeof(int))) == NULL)
+			return -1;
+		l->first[t][ids] = l->num_shards;
+		for (int s = l->num_shards - 1; s >= 0; s--)
+			l->first[t][node_id(l->core[s], t)] = s;
+	}
+
+	enum node_type top = level == MACHINE ? MACHINE : NUMA;
+	l->num_blocks = num_ids(top);
+	if ((l->blocks = calloc(l->num_blocks, sizeof(*l->blocks))) == NULL)
+		return -1;
+	for (int b = 0; b < l->num_blocks; b++) {
+		struct shard_block *block = &l->blocks[b];
+		int lo = l->first[top][b], hi = l->first[top][b + 1];
+		block->size = (hi - lo) * l->shard_size;
+		block->numa_node = numa_available() < 0 ? -1 :
+		                   numa_node_of_cpu(l->core[lo]->os_id);
+		if (block->numa_node >= 0)
+			block->mem = numa_alloc_onnode(block->size, block->numa_node);
+		else
+			block->mem = aligned_alloc(CACHE_LINE_SIZE, block->size);
+		if (block->mem == NULL)
+			return -1;
+		memset(block->mem, 0, block->size);
+		for (int s = lo; s < hi; s++)
+			l->shard[s] = block->mem + (s - lo) * l->shard_size;
+	}
+	return 0;
+}
+
+/* Threads on cores outside our topology all share the first shard. */
+static inline int current_shard(struct shard_layout *l)
+{
+	struct core_info *c = current_core();
+	return c ? node_id(c, l->level) : 0;
+}
+
+/* Call fn on shard s, then on the other shards below each of its ancestors
+ * in turn, up to its ancestor of type 'top', until fn returns true. Returns
+ * whether it did. */
+static bool walk_shards(struct shard_layout *l, int s, enum node_type top,
+                        bool (*fn)(void *shard, void *arg), void *arg)
+{
+	if (fn(l->shard[s], arg))
+		return true;
+	int lo = s, hi = s + 1;
+	for (int t = l->level + 1; t <= top; t++) {
+		int id = node_id(l->core[s], t);
+		int first = l->first[t][id], last = l->first[t][id + 1];
+		for (int i = first; i < last; i++) {
+			if (i == lo)
+				i = hi - 1;
+			else if (fn(l->shard[i], arg))
+				return true;
+		}
+		lo = first;
+		hi = last;
+	}
+	return false;
+}
+
+struct counter_shard {
+	long value;
+};
+
+struct shard_counter {
+	struct shard_layout layout;
+};
+
+struct shard_counter *shard_counter_create(enum node_type level)
+{
+	struct shard_counter *c = malloc(sizeof(struct shard_counter));
+	if (c == NULL)
+		return NULL;
+	if (init_layout(&c->layout, level, sizeof(struct counter_shard)) < 0) {
+		shard_counter_destroy(c);
+		return NULL;
+	}
+	return c;
+}
+
+void shard_counter_destroy(struct shard_counter *c)
+{
+	free_layout(&c->layout);
+	free(c);
+}
+
+void shard_counter_add(struct shard_counter *c, long v)
+{
+	struct counter_shard *sh = c->layout.shard[current_shard(&c->layout)];
+	__atomic_fetch_add(&sh->value, v, __ATOMIC_RELAXED);
+}
+
+long shard_counter_read_node(struct shard_counter *c, enum node_type type,
+                             int id)
+{
+	struct shard_layout *l = &c->layout;
+	if (type < l->level || type > MACHINE || id < 0 || id >= num_ids(type))
+		return 0;
+	long sum = 0;
+	for (int s = l->first[type][id]; s < l->first[type][id + 1]; s++) {
+		struct counter_shard *sh = l->shard[s];
+		sum += __atomic_load_n(&sh->value, __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+long shard_counter_read(struct shard_counter *c)
+{
+	return shard_counter_read_node(c, MACHINE, 0);
+}
+
+/* A stack of free objects, linked through their first word. */
+struct freelist_shard {
+	int lock;
+	int count;
+	void *head;
+};
+
+struct shard_freelist {
+	struct shard_layout layout;
+	size_t size;
+	int limit;
+};
+
+static void lock_shard(struct freelist_shard *sh)
+{
+	int spins = 0;
+	while (__atomic_exchange_n(&sh->lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&sh->lock, __ATOMIC_RELAXED)) {
+			if (++spins < SHARD_SPIN_LIMIT)
+				__builtin_ia32_pause();
+			else
+				sched_yield();
+		}
+	}
+}
+
+static void unlock_shard(struct freelist_shard *sh)
+{
+	__atomic_store_n(&sh->lock, 0, __ATOMIC_RELEASE);
+}
+
+struct shard_freelist *shard_freelist_create(enum node_type level,
+                                             size_t size, int limit)
+{
+	struct shard_freelist *f = malloc(sizeof(struct shard_freelist));
+	if (f == NULL)
+		return NULL;
+	f->size = size > sizeof(void *) ? size : sizeof(void *);
+	f->limit = limit > 0 ? limit : 0;
+	if (init_layout(&f->layout, level, sizeof(struct freelist_shard)) < 0) {
+		shard_freelist_destroy(f);
+		return NULL;
+	}
+	return f;
+}
+
+void shard_freelist_destroy(struct shard_freelist *f)
+{
+	for (int s = 0; f->layout.blocks && s < f->layout.num_shards; s++) {
+		struct freelist_shard *sh = f->layout.shard[s];
+		while (sh != NULL && sh->head != NULL) {
+			void *obj = sh->head;
+			sh->head = *(void **)obj;
+			free(obj);
+		}
+	}
+	free_layout(&f->layout);
+	free(f);
+}
+
+/* Pop an object off a shard into *(void **)arg. Empty shards are skipped
+ * without taking their lock. */
+static bool pop_object(void *shard, void *arg)
+{
+	struct freelist_shard *sh = shard;
+	void *obj = NULL;
+	if (__atomic_load_n(&sh->count, __ATOMIC_RELAXED) == 0)
+		return false;
+	lock_shard(sh);
+	if (sh->head != NULL) {
+		obj = sh->head;
+		sh->head = *(void **)obj;
+		sh->count--;
+	}
+	unlock_shard(sh);
+	*(void **)arg = obj;
+	return obj != NULL;
+}
+
+void *shard_freelist_get(struct shard_freelist *f)
+{
+	void *obj;
+	if (walk_shards(&f->layout, current_shard(&f->layout), NUMA,
+	                pop_object, &obj))
+		return obj;
+	return malloc(f->size);
+}
+
+void shard_freelist_put(struct shard_freelist *f, void *obj)
+{
+	struct freelist_shard *sh = f->layout.shard[current_shard(&f->layout)];
+	lock_shard(sh);
+	if (f->limit && sh->count >= f->limit) {
+		unlock_shard(sh);
+		free(obj);
+		return;
+	}
+	*(void **)obj = sh->head;
+	sh->head = obj;
+	sh->count++;
+	unlock_shard(sh);
+}
+
+/* A bounded ring in which each cell carries a sequence number telling
+ * producers and consumers whose turn it is, so that they only synchronize
+ * on the head or tail position they claim a cell with. */
+struct queue_cell {
+	unsigned long seq;
+	void *item;
+};
+
+struct queue_shard {
+	unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct queue_cell cells[] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+struct shard_queue {
+	struct shard_layout layout;
+	unsigned long mask;
+};
+
+struct queue_op {
+	struct shard_queue *q;
+	void *item;
+};
+
+struct shard_queue *shard_queue_create(enum node_type level, int capacity)
+{
+	struct shard_queue *q = malloc(sizeof(struct shard_queue));
+	if (q == NULL)
+		return NULL;
+	unsigned long cells = 2;
+	while (cells < (unsigned long)capacity)
+		cells *= 2;
+	q->mask = cells - 1;
+	if (init_layout(&q->layout, level, sizeof(struct queue_shard) +
+	                cells * sizeof(struct queue_cell)) < 0) {
+		shard_queue_destroy(q);
+		return NULL;
+	}
+	for (int s = 0; s < q->layout.num_shards; s++) {
+		struct queue_shard *sh = q->layout.shard[s];
+		for (unsigned long i = 0; i < cells; i++)
+			sh->cells[i].seq = i;
+	}
+	return q;
+}
+
+void shard_queue_destroy(struct shard_queue *q)
+{
+	free_layout(&q->layout);
+	free(q);
+}
+
+static bool push_item(void *shard, void *arg)
+{
+	struct queue_shard *sh = shard;
+	struct queue_op *op = arg;
+	unsigned long pos = __atomic_load_n(&sh->head, __ATOMIC_RELAXED);
+	struct queue_cell *cell;
+
+	for (;;) {
+		cell = &sh->cells[pos & op->q->mask];
+		unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		long diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&sh->head, &pos, pos + 1, true,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&sh->head, __ATOMIC_RELAXED);
+		}
+	}
+	cell->item = op->item;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool pop_item(void *shard, void *arg)
+{
+	struct queue_shard *sh = shard;
+	struct queue_op *op = arg;
+	unsigned long pos = __atomic_load_n(&sh->tail, __ATOMIC_RELAXED);
+	struct queue_cell *cell;
+
+	for (;;) {
+		cell = &sh->cells[pos & op->q->mask];
+		unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		long diff = (long)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&sh->tail, &pos, pos + 1, true,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&sh->tail, __ATOMIC_RELAXED);
+		}
+	}
+	op->item = cell->item;
+	__atomic_store_n(&cell->seq, pos + op->q->mask + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+int shard_queue_push(struct shard_queue *q, void *item)
+{
+	struct queue_op op = { q, item };
+	return walk_shards(&q->layout, current_shard(&q->layout), MACHINE,
+	                   push_item, &op) ? 0 : -1;
+}
+
+void *shard_queue_pop(struct shard_queue *q)
+{
+	struct queue_op op = { q, NULL };
+	if (walk_shards(&q->layout, current_shard(&q->layout), MACHINE,
+	                pop_item, &op))
+		return op.item;
+	return NULL;
+}
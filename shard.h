@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include <stddef.h>
+#include "topology.h"
+
+/* Data structures split into one shard per core, CPU, socket or NUMA node
+ * (or a single shard for MACHINE), each on the memory of its own NUMA node.
+ * Threads work on the shard of the core they run on, and only reach for
+ * other shards, nearest first, when theirs cannot serve them. All of them
+ * must be created after the topology is initialized, and return NULL on
+ * failure. */
+
+/* A counter whose increments only contend within a shard. */
+struct shard_counter;
+
+struct shard_counter *shard_counter_create(enum node_type level);
+void shard_counter_destroy(struct shard_counter *c);
+void shard_counter_add(struct shard_counter *c, long v);
+
+/* The sum of all shards, or of the shards below node id of the given type,
+ * which must be at or above the counter's level. Concurrent additions may
+ * or may not be included. */
+long shard_counter_read(struct shard_counter *c);
+long shard_counter_read_node(struct shard_counter *c, enum node_type type,
+                             int id);
+
+/* A cache of free objects of a given size. Objects put back go to the
+ * caller's shard, which keeps at most 'limit' of them (0 for no limit) and
+ * frees the rest. Gets take from the caller's shard, then from the nearest
+ * shards on the same NUMA node, and allocate a new object when all of them
+ * are empty. */
+struct shard_freelist;
+
+struct shard_freelist *shard_freelist_create(enum node_type level,
+                                             size_t size, int limit);
+void shard_freelist_destroy(struct shard_freelist *f);
+void *shard_freelist_get(struct shard_freelist *f);
+void shard_freelist_put(struct shard_freelist *f, void *obj);
+
+/* A multi-producer multi-consumer queue of pointers, made of one bounded
+ * lock-free ring per shard, holding 'capacity' items (rounded up to a power
+ * of two) each. Items are pushed to the caller's ring, or the nearest one
+ * with room, and popped from the caller's ring, or the nearest one holding
+ * any. Order is only FIFO within a ring. */
+struct shard_queue;
+
+struct shard_queue *shard_queue_create(enum node_type level, int capacity);
+void shard_queue_destroy(struct shard_queue *q);
+
+/* Returns 0, or -1 if every ring is full. */
+int shard_queue_push(struct shard_queue *q, void *item);
+
+/* Returns NULL if every ring is empty. */
+void *shard_queue_pop(struct shard_queue *q);
+
+#endif /* !SHARD_H_ */
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "schedule.h"
+#include "stats.h"
+
+static const char *counter_label[NUM_SCHED_COUNTERS] = {
+	"allocs", "frees", "provisions", "searches", "candidates", "fallbacks",
+	"batches", "batched"
+};
+static const char *hist_label[NUM_SCHED_HISTS] = {
+	"alloc", "free", "provision", "batch", "queued"
+};
+
+#ifdef CONFIG_SCHED_STATS
+
+/* Every thread that ever touched the scheduler has its stats on this list.
+ * Entries are never removed, so the counts of exited threads are kept. */
+struct stats_entry {
+	struct sched_stats stats;
+	struct stats_entry *next;
+};
+static struct stats_entry *stats_list;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct sched_stats *my_sched_stats;
+
+struct sched_stats *sched_stats_register()
+{
+	struct stats_entry *e = calloc(1, sizeof(struct stats_entry));
+	if (e == NULL)
+		exit(-1);
+	pthread_mutex_lock(&stats_lock);
+	e->next = stats_list;
+	stats_list = e;
+	pthread_mutex_unlock(&stats_lock);
+	my_sched_stats = &e->stats;
+	return my_sched_stats;
+}
+
+uint64_t sched_stats_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+	if (ns < HIST_SUB_BUCKETS)
+		return ns;
+	int msb = 63 - __builtin_clzll(ns);
+	int shift = msb - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) +
+	       ((ns >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+void __stats_record(struct latency_hist *h, uint64_t ns)
+{
+	h->count++;
+	h->sum += ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->buckets[hist_bucket(ns)]++;
+}
+
+#endif /* CONFIG_SCHED_STATS */
+
+/* Sum the stats of all threads into 'out'. The per-thread copies are read
+ * without stopping their owners, so a snapshot taken under load may be off
+ * by the few updates that were in flight. */
+void sched_stats_snapshot(struct sched_stats *out)
+{
+	memset(out, 0, sizeof(struct sched_stats));
+#ifdef CONFIG_SCHED_STATS
+	pthread_mutex_lock(&stats_lock);
+	for (struct stats_entry *e = stats_list; e; e = e->next) {
+		for (int i = 0; i < NUM_SCHED_COUNTERS; i++)
+			out->counters[i] += e->stats.counters[i];
+		for (int i = 0; i < NUM_SCHED_HISTS; i++) {
+			struct latency_hist *src = &e->stats.hists[i];
+			struct latency_hist *dst = &out->hists[i];
+			dst->count += src->count;
+			dst->sum += src->sum;
+			if (src->max > dst->max)
+				dst->max = src->max;
+			for (int j = 0; j < HIST_BUCKETS; j++)
+				dst->buckets[j] += src->buckets[j];
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+/* Returns the lowest value that falls into the given bucket. */
+static uint64_t bucket_value(int bucket)
+{
+	if (bucket < HIST_SUB_BUCKETS)
+		return bucket;
+	int shift = (bucket >> HIST_SUB_BITS) - 1;
+	uint64_t sub = bucket & (HIST_SUB_BUCKETS - 1);
+	return (HIST_SUB_BUCKETS + sub) << shift;
+}
+
+uint64_t hist_percentile(struct latency_hist *h, double percentile)
+{
+	uint64_t target = h->count * percentile / 100.0;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > target)
+			return bucket_value(i);
+	}
+	return h->max;
+}
+
+/* Where and how the expected clock of each proc gets dumped. */
+struct freq_dump {
+	FILE *f;
+	bool json;
+	bool first;
+};
+
+static void dump_proc_freq(struct proc *p, void *arg)
+{
+	struct freq_dump *d = arg;
+	struct sched_pcore *c;
+	int cores = 0;
+	int khz = sched_proc_freq(p);
+
+	if (khz == 0)
+		return;
+	STAILQ_FOREACH(c, &p->ksched_data.alloc_me, alloc_next)
+		cores++;
+	if (d->json)
+		fprintf(d->f, "%s\n    {\"pid\": %d, \"cores\": %d, "
+		        "\"expected_mhz\": %d}", d->first ? "" : ",", p->pid, cores,
+		        khz / 1000);
+	else
+		fprintf(d->f, "proc %6d cores: %3d expected MHz: %d\n", p->pid,
+		        cores, khz / 1000);
+	d->first = false;
+}
+
+static void dump_text(FILE *f, struct sched_stats *s)
+{
+	for (int i = 0; i < NUM_SCHED_COUNTERS; i++)
+		fprintf(f, "%-12s %llu\n", counter_label[i],
+		        (unsigned long long)s->counters[i]);
+	for (int i = 0; i < NUM_SCHED_HISTS; i++) {
+		struct latency_hist *h = &s->hists[i];
+		fprintf(f, "%-12s count: %llu, avg: %llu ns, p50: %llu ns, "
+		        "p99: %llu ns, p99.9: %llu ns, max: %llu ns\n",
+		        hist_label[i], (unsigned long long)h->count,
+		        (unsigned long long)(h->count ? h->sum / h->count : 0),
+		        (unsigned long long)hist_percentile(h, 50),
+		        (unsigned long long)hist_percentile(h, 99),
+		        (unsigned long long)hist_percentile(h, 99.9),
+		        (unsigned long long)h->max);
+	}
+	for (int t = NUMA; t >= CPU; t--) {
+		for (int id = 0; id < sched_num_nodes(t); id++) {
+			int used, total, stranded;
+			sched_node_usage(t, id, &used, &total, &stranded);
+			fprintf(f, "%-6s %3d used: %3d/%-3d stranded: %d\n",
+			        node_label[t], id, used, total, stranded);
+		}
+	}
+	for (int c = 0; c < NUM_CORE_CLASSES; c++) {
+		int used, total;
+		sched_class_usage(c, &used, &total);
+		fprintf(f, "%-10s used: %3d/%d\n", class_label[c], used, total);
+	}
+	struct freq_dump d = { f, false, true };
+	sched_for_each_proc(dump_proc_freq, &d);
+}
+
+static void dump_json(FILE *f, struct sched_stats *s)
+{
+	fprintf(f, "{\n  \"counters\": {");
+	for (int i = 0; i < NUM_SCHED_COUNTERS; i++)
+		fprintf(f, "%s\n    \"%s\": %llu", i ? "," : "", counter_label[i],
+		        (unsigned long long)s->counters[i]);
+	fprintf(f, "\n  },\n  \"latency_ns\": {");
+	for (int i = 0; i < NUM_SCHED_HISTS; i++) {
+		struct latency_hist *h = &s->hists[i];
+		fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"avg\": %llu, "
+		        "\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+		        i ? "," : "", hist_label[i], (unsigned long long)h->count,
+		        (unsigned long long)(h->count ? h->sum / h->count : 0),
+		        (unsigned long long)hist_percentile(h, 50),
+		        (unsigned long long)hist_percentile(h, 99),
+		        (unsigned long long)hist_percentile(h, 99.9),
+		        (unsigned long long)h->max);
+	}
+	fprintf(f, "\n  },\n  \"nodes\": [");
+	bool first = true;
+	for (int t = NUMA; t >= CPU; t--) {
+		for (int id = 0; id < sched_num_nodes(t); id++) {
+			int used, total, stranded;
+			sched_node_usage(t, id, &used, &total, &stranded);
+			fprintf(f, "%s\n    {\"type\": \"%s\", \"id\": %d, \"used\": %d, "
+			        "\"total\": %d, \"stranded\": %d}", first ? "" : ",",
+			        node_label[t], id, used, total, stranded);
+			first = false;
+		}
+	}
+	fprintf(f, "\n  ],\n  \"classes\": {");
+	for (int c = 0; c < NUM_CORE_CLASSES; c++) {
+		int used, total;
+		sched_class_usage(c, &used, &total);
+		fprintf(f, "%s\n    \"%s\": {\"used\": %d, \"total\": %d}",
+		        c ? "," : "", class_label[c], used, total);
+	}
+	fprintf(f, "\n  },\n  \"procs\": [");
+	struct freq_dump d = { f, true, true };
+	sched_for_each_proc(dump_proc_freq, &d);
+	fprintf(f, "\n  ]\n}\n");
+}
+
+/* Print a snapshot of our stats, along with the occupancy of every node in
+ * the hierarchy, either as text or as JSON. */
+void sched_stats_dump(FILE *f, bool json)
+{
+	struct sched_stats *s = malloc(sizeof(struct sched_stats));
+	if (s == NULL)
+		return;
+	sched_stats_snapshot(s);
+	if (json)
+		dump_json(f, s);
+	else
+		dump_text(f, s);
+	free(s);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+enum sched_counter {
+	STAT_ALLOCS,        /* Cores handed out */
+	STAT_FREES,         /* Cores given back */
+	STAT_PROVISIONS,    /* Cores provisioned */
+	STAT_SEARCHES,      /* Calls to alloc_best_core() */
+	STAT_CANDIDATES,    /* Free cores scored by find_best_core() */
+	STAT_FALLBACKS,     /* Searches that had to go past the CPU level */
+	STAT_BATCHES,       /* Batches run by sched_run_batch() */
+	STAT_BATCHED,       /* Requests run as part of a batch */
+	NUM_SCHED_COUNTERS
+};
+
+enum sched_hist {
+	HIST_ALLOC,
+	HIST_FREE,
+	HIST_PROVISION,
+	HIST_BATCH,         /* Time to run a whole batch */
+	HIST_QUEUED,        /* Time from submitting a request to its completion */
+	NUM_SCHED_HISTS
+};
+
+/* Our latency histograms are HDR style: values below 2^HIST_SUB_BITS ns get
+ * a bucket each, and every power of 2 above that is split into
+ * 2^HIST_SUB_BITS linear sub-buckets, for a worst case error of ~6%. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct latency_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+struct sched_stats {
+	uint64_t counters[NUM_SCHED_COUNTERS];
+	struct latency_hist hists[NUM_SCHED_HISTS];
+};
+
+#ifdef CONFIG_SCHED_STATS
+
+/* Each thread updates its own copy of the stats, so no atomics are needed on
+ * the update path. The copies are summed up by sched_stats_snapshot(). */
+extern __thread struct sched_stats *my_sched_stats;
+struct sched_stats *sched_stats_register();
+
+static inline struct sched_stats *__sched_stats()
+{
+	if (my_sched_stats == NULL)
+		return sched_stats_register();
+	return my_sched_stats;
+}
+
+uint64_t sched_stats_now();
+void __stats_record(struct latency_hist *h, uint64_t ns);
+
+#define stats_count(counter, n) \
+	(__sched_stats()->counters[(counter)] += (n))
+#define stats_start() sched_stats_now()
+#define stats_record(hist, start) \
+	__stats_record(&__sched_stats()->hists[(hist)], \
+	               sched_stats_now() - (start))
+
+#else
+
+#define stats_count(counter, n) do {} while (0)
+#define stats_start() 0
+#define stats_record(hist, start) do { (void)(start); } while (0)
+
+#endif /* CONFIG_SCHED_STATS */
+
+void sched_stats_snapshot(struct sched_stats *out);
+uint64_t hist_percentile(struct latency_hist *h, double percentile);
+void sched_stats_dump(FILE *f, bool json);
+
+#endif /* !STATS_H_ */
@@ -32,6 +32,7 @@
 #define _GNU_SOURCE
 #include <sys/sysinfo.h>
 #include <stdio.h>
+#include <errno.h>
 #include <sched.h>
 #include <malloc.h>
 #include <string.h>
@@ -39,6 +40,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <numa.h>
 #include "arch.h"
 #include "acpi.h"
 #include "topology.h"
@@ -46,6 +48,9 @@
 struct topology_info cpu_topology_info;
 int *os_coreid_lookup;
 
+/* Maps an OS core id to its index in core_list, or -1. */
+static int os_id_lookup[CPU_SETSIZE];
+
 #define num_cores           (cpu_topology_info.num_cores)
 #define num_cpus            (cpu_topology_info.num_cpus)
 #define num_sockets         (cpu_topology_info.num_sockets)
@@ -115,6 +120,21 @@ static int find_numa_domain(int apic_id)
 	}
 }
 
+static int find_os_id(int apic_id)
+{
+	/* Loop through our Apic table to find the OS core number (the one passed
+	 * to sched_setaffinity()) that reported the given apic_id. */
+	struct Apicst *temp = apics->st;
+	while (temp) {
+		if (temp->type == ASlapic) {
+			if (temp->lapic.id == apic_id)
+				return temp->lapic.os_id;
+		}
+		temp = temp->next;
+	}
+	return -1;
+}
+
 static void set_num_cores()
 {
 	/* Figure out the maximum number of cores we actually have and set it in
@@ -210,6 +230,7 @@ static void init_core_list(uint32_t core_bits, uint32_t cpu_bits)
 			core_list[os_coreid].cpu_id = cpu_id;
 			core_list[os_coreid].core_id = core_id;
 			core_list[os_coreid].apic_id = apic_id;
+			core_list[os_coreid].os_id = find_os_id(apic_id);
 			os_coreid++;
 		}
 	}
@@ -254,47 +275,95 @@ static void init_core_list_flat()
 			core_list[os_coreid].cpu_id = 0;
 			core_list[os_coreid].core_id = os_coreid;
 			core_list[os_coreid].apic_id = apic_id;
+			core_list[os_coreid].os_id = find_os_id(apic_id);
 			os_coreid++;
 		}
 	}
 }
 
+static int compare_cores(const void *a, const void *b)
+{
+	const struct core_info *ca = a, *cb = b;
+	if (ca->numa_id != cb->numa_id)
+		return ca->numa_id - cb->numa_id;
+	if (ca->socket_id != cb->socket_id)
+		return ca->socket_id - cb->socket_id;
+	if (ca->cpu_id != cb->cpu_id)
+		return ca->cpu_id - cb->cpu_id;
+	if (ca->core_id != cb->core_id)
+		return ca->core_id - cb->core_id;
+	return ca->apic_id - cb->apic_id;
+}
+
 static void set_remaining_topology_info()
 {
-	/* Assuming we have our core_list set up with relative topology info, loop
-	 * through our core_list and calculate the other statistics that we hold
-	 * in our cpu_topology_info struct. */
-	int last_numa = -1, last_socket = -1, last_cpu = -1, last_core = -1;
+	/* Assuming we have our core_list set up with relative topology info, sort
+	 * it so that the cores of every numa domain, socket and cpu form a
+	 * contiguous range, then walk it and hand out absolute ids in order. We
+	 * make no assumption that all nodes at a level have the same number of
+	 * children: offline cores, SMT disabled on some packages or sparse
+	 * cpusets all leave us with irregular shapes. The *_per_* fields end up
+	 * holding the largest fan-out seen at each level. */
+	qsort(core_list, num_cores, sizeof(struct core_info), compare_cores);
+
+	memset(os_id_lookup, -1, sizeof(os_id_lookup));
+
+	int numa = -1, socket = -1, cpu = -1;
+	int last_numa = -1, last_socket = -1, last_cpu = -1;
+	int numa_sockets = 0, numa_cpus = 0, numa_cores = 0;
+	int socket_cpus = 0, socket_cores = 0, cpu_cores = 0;
 	for (int i = 0; i < num_cores; i++) {
-		if (core_list[i].socket_id > last_socket) {
-			last_socket = core_list[i].socket_id;
-			sockets_per_numa++;
+		struct core_info *c = &core_list[i];
+		bool new_numa = (i == 0 || c->numa_id != last_numa);
+		bool new_socket = new_numa || c->socket_id != last_socket;
+		bool new_cpu = new_socket || c->cpu_id != last_cpu;
+		last_numa = c->numa_id;
+		last_socket = c->socket_id;
+		last_cpu = c->cpu_id;
+
+		if (new_numa) {
+			numa++;
+			numa_sockets = numa_cpus = numa_cores = 0;
 		}
-		if (core_list[i].cpu_id > last_cpu) {
-			last_cpu = core_list[i].cpu_id;
-			cpus_per_socket++;
+		if (new_socket) {
+			socket++;
+			socket_cpus = socket_cores = 0;
+			numa_sockets++;
 		}
-		if (core_list[i].core_id > last_core) {
-			last_core = core_list[i].core_id;
-			cores_per_cpu++;
+		if (new_cpu) {
+			cpu++;
+			cpu_cores = 0;
+			socket_cpus++;
+			numa_cpus++;
 		}
-	}
-	cores_per_socket = cpus_per_socket * cores_per_cpu;
-	cores_per_numa = sockets_per_numa * cores_per_socket;
-	cpus_per_numa = sockets_per_numa * cpus_per_socket;
-	num_sockets = sockets_per_numa * num_numa;
-	num_cpus = cpus_per_socket * num_sockets;
-}
+		cpu_cores++;
+		socket_cores++;
+		numa_cores++;
 
-static void update_core_list_with_absolute_ids()
-{
-	/* Fix up our core_list to have absolute id's at every level. */
-	for (int i = 0; i < num_cores; i++) {
-		struct core_info *c = &core_list[i];
-		c->socket_id = num_sockets/num_numa * c->numa_id + c->socket_id;
-		c->cpu_id = num_cpus/num_sockets * c->socket_id + c->cpu_id;
-		c->core_id = num_cores/num_cpus * c->cpu_id + c->core_id;
+		c->numa_id = numa;
+		c->socket_id = socket;
+		c->cpu_id = cpu;
+		c->core_id = i;
+		os_coreid_lookup[c->apic_id] = i;
+		if (c->os_id >= 0 && c->os_id < CPU_SETSIZE)
+			os_id_lookup[c->os_id] = i;
+
+		if (numa_sockets > sockets_per_numa)
+			sockets_per_numa = numa_sockets;
+		if (numa_cpus > cpus_per_numa)
+			cpus_per_numa = numa_cpus;
+		if (numa_cores > cores_per_numa)
+			cores_per_numa = numa_cores;
+		if (socket_cpus > cpus_per_socket)
+			cpus_per_socket = socket_cpus;
+		if (socket_cores > cores_per_socket)
+			cores_per_socket = socket_cores;
+		if (cpu_cores > cores_per_cpu)
+			cores_per_cpu = cpu_cores;
 	}
+	num_numa = numa + 1;
+	num_sockets = socket + 1;
+	num_cpus = cpu + 1;
 }
 
 static void build_topology(uint32_t core_bits, uint32_t cpu_bits)
@@ -305,7 +374,6 @@ static void build_topology(uint32_t core_bits, uint32_t cpu_bits)
 	init_os_coreid_lookup();
 	init_core_list(core_bits, cpu_bits);
 	set_remaining_topology_info();
-	update_core_list_with_absolute_ids();
 }
 
 static void build_flat_topology()
@@ -318,6 +386,16 @@ static void build_flat_topology()
 	set_remaining_topology_info();
 }
 
+/* Record which OS cores are online on the machine, and which of them we
+ * may use. Our core_list only ever covers the allowed ones. */
+static void init_cpu_masks()
+{
+	get_allowed_cpus(&cpu_topology_info.allowed_cpus);
+	if (read_cpulist("/sys/devices/system/cpu/online",
+	                 &cpu_topology_info.online_cpus) != 0)
+		cpu_topology_info.online_cpus = cpu_topology_info.allowed_cpus;
+}
+
 void topology_init()
 {
 	uint32_t eax, ebx, ecx, edx;
@@ -339,34 +417,187 @@ void topology_init()
 			cpu_bits = cpu_bits - core_bits;
 		}
 	}
+	init_cpu_masks();
 	if (cpu_bits)
 		build_topology(core_bits, cpu_bits);
 	else 
 		build_flat_topology();
 }
 
+/* Set up a core_list of 'n' cores for a machine we are not running on. Apic
+ * ids and OS ids are simply the core's index. */
+static void init_fake_core_list(int n)
+{
+	memset(&cpu_topology_info, 0, sizeof(cpu_topology_info));
+	num_cores = n;
+	max_apic_id = num_cores - 1;
+	core_list = calloc(num_cores, sizeof(struct core_info));
+	os_coreid_lookup = malloc(num_cores * sizeof(int));
+	for (int i = 0; i < num_cores; i++) {
+		core_list[i].apic_id = i;
+		core_list[i].os_id = i;
+		os_coreid_lookup[i] = i;
+		if (i < CPU_SETSIZE) {
+			CPU_SET(i, &cpu_topology_info.online_cpus);
+			CPU_SET(i, &cpu_topology_info.allowed_cpus);
+		}
+	}
+}
+
+/* Build a regular topology from its shape alone, without looking at the
+ * machine we are running on. This is used to run the scheduler against
+ * machines we do not have, e.g. in the trace simulator. */
+void topology_init_synthetic(int numa, int sockets_per_numa_,
+                             int cpus_per_socket_, int cores_per_cpu_)
+{
+	int socket_cores = cpus_per_socket_ * cores_per_cpu_;
+	int numa_cores = sockets_per_numa_ * socket_cores;
+
+	init_fake_core_list(numa * numa_cores);
+	for (int i = 0; i < num_cores; i++) {
+		core_list[i].numa_id = i / numa_cores;
+		core_list[i].socket_id = i / socket_cores;
+		core_list[i].raw_socket_id = core_list[i].socket_id;
+		core_list[i].cpu_id = i / cores_per_cpu_;
+		core_list[i].core_id = i;
+	}
+	set_remaining_topology_info();
+}
+
+/* Build a topology described by a file with one line per core, holding the
+ * numa, socket and cpu the core belongs to. Ids only need to be unique, so
+ * any shape can be described, regular or not. Returns 0 on success. */
+int topology_init_from_file(const char *path)
+{
+	int numa, socket, cpu, n = 0, size = 64;
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	struct core_info *cores = malloc(size * sizeof(struct core_info));
+	if (cores == NULL) {
+		fclose(f);
+		return -1;
+	}
+	while (fscanf(f, "%d %d %d", &numa, &socket, &cpu) == 3) {
+		if (n == size) {
+			size *= 2;
+			struct core_info *more =
+				realloc(cores, size * sizeof(struct core_info));
+			if (more == NULL) {
+				fclose(f);
+				free(cores);
+				return -1;
+			}
+			cores = more;
+		}
+		cores[n].numa_id = numa;
+		cores[n].socket_id = socket;
+		cores[n].raw_socket_id = socket;
+		cores[n].cpu_id = cpu;
+		cores[n].core_id = n;
+		n++;
+	}
+	fclose(f);
+	if (n == 0) {
+		free(cores);
+		return -1;
+	}
+
+	init_fake_core_list(n);
+	for (int i = 0; i < n; i++) {
+		cores[i].apic_id = core_list[i].apic_id;
+		cores[i].os_id = core_list[i].os_id;
+	}
+	free(core_list);
+	core_list = cores;
+	set_remaining_topology_info();
+	return 0;
+}
+
+struct core_info *core_of_os_id(int os_id)
+{
+	if (os_id < 0 || os_id >= CPU_SETSIZE || os_id_lookup[os_id] < 0)
+		return NULL;
+	return &core_list[os_id_lookup[os_id]];
+}
+
+/* Find the core we are running on. sched_getcpu() is served from the vdso
+ * (or rseq) and costs a few nanoseconds, whereas cpuid serializes the
+ * pipeline and traps to the hypervisor under virtualization, so we only
+ * fall back on the apic id when the OS id is unknown to us. Returns NULL if
+ * we run on a core outside our topology, e.g. one our affinity or cpuset
+ * does not allow. */
+struct core_info *current_core()
+{
+	struct core_info *c = core_of_os_id(sched_getcpu());
+	if (c != NULL)
+		return c;
+	if (os_coreid_lookup == NULL)
+		return NULL;
+	int apic_id = get_apic_id();
+	if (apic_id < 0 || apic_id > max_apic_id)
+		return NULL;
+	int i = os_coreid_lookup[apic_id];
+	if (i < 0 || i >= num_cores || core_list[i].apic_id != apic_id)
+		return NULL;
+	return &core_list[i];
+}
+
 int numa_domain()
 {
-	int os_coreid = os_coreid_lookup[get_apic_id()];
-	return core_list[os_coreid].numa_id;
+	struct core_info *c = current_core();
+	return c ? c->numa_id : -1;
 }
 
 int socket_id()
 {
-	int os_coreid = os_coreid_lookup[get_apic_id()];
-	return core_list[os_coreid].socket_id;
+	struct core_info *c = current_core();
+	return c ? c->socket_id : -1;
 }
 
 int cpu_id()
 {
-	int os_coreid = os_coreid_lookup[get_apic_id()];
-	return core_list[os_coreid].cpu_id;
+	struct core_info *c = current_core();
+	return c ? c->cpu_id : -1;
 }
 
 int core_id()
 {
-	int os_coreid = os_coreid_lookup[get_apic_id()];
-	return core_list[os_coreid].core_id;
+	struct core_info *c = current_core();
+	return c ? c->core_id : -1;
+}
+
+/* Write a header describing the shape of this machine as constants, for
+ * building the scheduler against with CONFIG_SCHED_SKU. Only regular
+ * machines, with the same fan-out at every node of a level, have such a
+ * shape. Returns 0 on success, or -1 with errno set. */
+int write_sku_header(const char *path)
+{
+	if (num_sockets != num_numa * sockets_per_numa ||
+	    num_cpus != num_sockets * cpus_per_socket ||
+	    num_cores != num_cpus * cores_per_cpu) {
+		errno = EINVAL;
+		return -1;
+	}
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "/* Generated by write_sku_header() for a %dx%dx%dx%d machine\n"
+	        " * (numa x sockets x cpus x cores). Do not edit. */\n\n"
+	        "#ifndef SKU_TOPOLOGY_H_\n"
+	        "#define SKU_TOPOLOGY_H_\n\n",
+	        num_numa, sockets_per_numa, cpus_per_socket, cores_per_cpu);
+	fprintf(f, "#define SKU_NAME             \"%dx%dx%dx%d\"\n",
+	        num_numa, sockets_per_numa, cpus_per_socket, cores_per_cpu);
+	fprintf(f, "#define SKU_NUM_NUMA         %d\n", num_numa);
+	fprintf(f, "#define SKU_SOCKETS_PER_NUMA %d\n", sockets_per_numa);
+	fprintf(f, "#define SKU_CPUS_PER_SOCKET  %d\n", cpus_per_socket);
+	fprintf(f, "#define SKU_CORES_PER_CPU    %d\n", cores_per_cpu);
+	fprintf(f, "#define SKU_CORES_PER_SOCKET %d\n", cores_per_socket);
+	fprintf(f, "#define SKU_CORES_PER_NUMA   %d\n", cores_per_numa);
+	fprintf(f, "#define SKU_NUM_CORES        %d\n\n", num_cores);
+	fprintf(f, "#endif /* !SKU_TOPOLOGY_H_ */\n");
+	return fclose(f) == 0 ? 0 : -1;
 }
 
 void print_cpu_topology() 
@@ -386,3 +617,38 @@ void print_cpu_topology()
 	}
 }
 
+/* Returns an integer read from the topology directory of an OS core in
+ * sysfs, or -1 if it is not available. */
+static int read_cpu_topology_id(int os_id, const char *name)
+{
+	char path[128];
+	int val = -1;
+	snprintf(path, sizeof(path),
+	         "/sys/devices/system/cpu/cpu%d/topology/%s", os_id, name);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &val) != 1)
+		val = -1;
+	fclose(f);
+	return val;
+}
+
+/* Print every online core of the machine as the kernel sees it, including
+ * the ones outside of our cpuset that the scheduler never uses. */
+void print_machine_topology()
+{
+	printf("online cores: %d, allowed cores: %d\n",
+	       CPU_COUNT(&cpu_topology_info.online_cpus),
+	       CPU_COUNT(&cpu_topology_info.allowed_cpus));
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, &cpu_topology_info.online_cpus))
+			continue;
+		printf("OScoreid: %3d, Numa Domain: %3d, Package: %3d, "
+		       "Core: %3d, %s\n", i, numa_node_of_cpu(i),
+		       read_cpu_topology_id(i, "physical_package_id"),
+		       read_cpu_topology_id(i, "core_id"),
+		       CPU_ISSET(i, &cpu_topology_info.allowed_cpus) ?
+		       "allowed" : "not allowed");
+	}
+}
@@ -17,8 +17,11 @@ struct core_info {
 	int core_id;
 	int raw_socket_id;
 	int apic_id;
+	int os_id;
 };
 
+/* The *_per_* fields hold the largest fan-out found at each level. Nodes at
+ * the same level may have fewer children, e.g. with offline cores. */
 struct topology_info {
 	int num_cores;
 	int num_cpus;
@@ -32,16 +35,30 @@ struct topology_info {
 	int sockets_per_numa;
 	int max_apic_id;
 	struct core_info *core_list;
+	cpu_set_t online_cpus;
+	cpu_set_t allowed_cpus;
 };
 
 extern struct topology_info cpu_topology_info;
 extern int *os_coreid_lookup;
 
+/* The core the caller is running on, and the core with a given OS id (NULL
+ * if it is not one of ours). */
+struct core_info *current_core();
+struct core_info *core_of_os_id(int os_id);
+
+/* The ids of the core the caller is running on, or -1 if it is not one of
+ * ours. */
 int numa_domain();
 int socket_id();
 int cpu_id();
 int core_id();
 
 void topology_init();
+void topology_init_synthetic(int numa, int sockets_per_numa,
+                             int cpus_per_socket, int cores_per_cpu);
+int topology_init_from_file(const char *path);
+int write_sku_header(const char *path);
 void print_cpu_topology();
+void print_machine_topology();
 #endif /* !TOPOLOGY_H_ */
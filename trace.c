@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+#ifdef CONFIG_SCHED_TRACE
+
+bool trace_enabled;
+__thread struct trace_ring *my_trace_ring;
+
+/* Every thread that ever traced an event has its ring on this list. Rings
+ * are never freed, so events of exited threads are still drained. */
+static struct trace_ring *ring_list;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE *trace_file;
+static pthread_t drain_thread;
+static int drain_interval_ms;
+static volatile bool draining;
+
+struct trace_ring *trace_ring_register()
+{
+	struct trace_ring *r = calloc(1, sizeof(struct trace_ring));
+	if (r == NULL)
+		exit(-1);
+	pthread_mutex_lock(&ring_lock);
+	r->next = ring_list;
+	ring_list = r;
+	pthread_mutex_unlock(&ring_lock);
+	my_trace_ring = r;
+	return r;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Estimate the tsc frequency so trace readers can turn tsc values into
+ * time. 10ms of sampling is plenty for the precision we need. */
+static uint64_t measure_tsc_per_us()
+{
+	uint64_t ns = now_ns(), tsc = read_tsc();
+	usleep(10000);
+	uint64_t dns = now_ns() - ns, dtsc = read_tsc() - tsc;
+	return dns / 1000 ? dtsc / (dns / 1000) : 0;
+}
+
+/* Copy all buffered records of all threads to 'f'. Returns the number of
+ * records written. */
+size_t trace_drain(FILE *f)
+{
+	size_t n = 0;
+	pthread_mutex_lock(&ring_lock);
+	for (struct trace_ring *r = ring_list; r; r = r->next) {
+		uint64_t tail = r->tail;
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			/* Write out the contiguous run up to the end of the ring. */
+			uint64_t idx = tail & (TRACE_RING_SIZE - 1);
+			uint64_t run = TRACE_RING_SIZE - idx;
+			if (run > head - tail)
+				run = head - tail;
+			fwrite(&r->records[idx], sizeof(struct trace_record), run, f);
+			tail += run;
+			n += run;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&ring_lock);
+	return n;
+}
+
+uint64_t trace_drops()
+{
+	uint64_t drops = 0;
+	pthread_mutex_lock(&ring_lock);
+	for (struct trace_ring *r = ring_list; r; r = r->next)
+		drops += r->drops;
+	pthread_mutex_unlock(&ring_lock);
+	return drops;
+}
+
+static void *drain_loop(void *arg)
+{
+	while (draining) {
+		usleep(drain_interval_ms * 1000);
+		trace_drain(trace_file);
+	}
+	return NULL;
+}
+
+/* Start tracing to 'path', draining the per thread rings every
+ * 'interval_ms' from a background thread. Returns 0 on success. */
+int trace_start(const char *path, int interval_ms)
+{
+	struct trace_header h;
+
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL)
+		return -1;
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.version = TRACE_VERSION;
+	h.record_size = sizeof(struct trace_record);
+	h.tsc_per_us = measure_tsc_per_us();
+	fwrite(&h, sizeof(h), 1, trace_file);
+
+	drain_interval_ms = interval_ms > 0 ? interval_ms : 1;
+	draining = true;
+	if (pthread_create(&drain_thread, NULL, drain_loop, NULL) != 0) {
+		fclose(trace_file);
+		return -1;
+	}
+	trace_enabled = true;
+	return 0;
+}
+
+/* Stop tracing, drain whatever is left and close the trace file. */
+void trace_stop()
+{
+	if (!trace_enabled)
+		return;
+	trace_enabled = false;
+	draining = false;
+	pthread_join(drain_thread, NULL);
+	trace_drain(trace_file);
+	fclose(trace_file);
+}
+
+#else
+
+int trace_start(const char *path, int interval_ms)
+{
+	return -1;
+}
+
+void trace_stop()
+{
+}
+
+size_t trace_drain(FILE *f)
+{
+	return 0;
+}
+
+uint64_t trace_drops()
+{
+	return 0;
+}
+
+#endif /* CONFIG_SCHED_TRACE */
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2015 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "arch.h"
+
+enum trace_event {
+	TRACE_ALLOC,
+	TRACE_FREE,
+	TRACE_PROVISION,
+	TRACE_DEPROVISION,
+	NUM_TRACE_EVENTS
+};
+
+/* One scheduling decision, as written to a trace file. 'distance' is the
+ * core_distance of the chosen core to the cores the proc already owned, and
+ * 'candidates' the number of cores scored to find it. */
+struct trace_record {
+	uint64_t tsc;
+	uint32_t pid;
+	uint32_t distance;
+	uint32_t candidates;
+	uint16_t core;
+	uint8_t event;
+	uint8_t pad;
+};
+
+/* A trace file is a trace_header followed by trace_records, in no
+ * particular order. Records can be sorted by tsc, which converts to ns
+ * through tsc_per_us. */
+#define TRACE_MAGIC "CPUTRACE"
+#define TRACE_VERSION 2
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t tsc_per_us;
+};
+
+/* The number of records each thread can buffer between two drains. Must be
+ * a power of 2. Events that do not fit are dropped and counted. */
+#define TRACE_RING_SIZE 4096
+
+/* A single producer, single consumer ring. Only the owning thread moves
+ * 'head' and only the drainer moves 'tail'. */
+struct trace_ring {
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t drops;
+	uint64_t tail __attribute__((aligned(64)));
+	struct trace_ring *next;
+	struct trace_record records[TRACE_RING_SIZE];
+};
+
+#ifdef CONFIG_SCHED_TRACE
+
+extern bool trace_enabled;
+extern __thread struct trace_ring *my_trace_ring;
+struct trace_ring *trace_ring_register();
+
+static inline void trace_event(int event, uint32_t pid, int core,
+                               int distance, int candidates)
+{
+	if (!trace_enabled)
+		return;
+	struct trace_ring *r = my_trace_ring;
+	if (r == NULL)
+		r = trace_ring_register();
+
+	uint64_t head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+	    TRACE_RING_SIZE) {
+		r->drops++;
+		return;
+	}
+	struct trace_record *rec = &r->records[head & (TRACE_RING_SIZE - 1)];
+	rec->tsc = read_tsc();
+	rec->pid = pid;
+	rec->distance = distance;
+	rec->core = core;
+	rec->candidates = candidates;
+	rec->event = event;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#else
+
+#define trace_event(event, pid, core, distance, candidates) do {} while (0)
+
+#endif /* CONFIG_SCHED_TRACE */
+
+int trace_start(const char *path, int drain_interval_ms);
+void trace_stop();
+size_t trace_drain(FILE *f);
+uint64_t trace_drops();
+
+#endif /* !TRACE_H_ */